@@ -3,12 +3,14 @@
  */
 
 #include <unistd.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <sys/types.h>
 #include <dirent.h>
 #include <string.h>
 #include <fnmatch.h>
+#include <syslog.h>
 #ifdef ACPI_APM
 #include "apm.h"
 #endif
@@ -19,6 +21,7 @@
 #include "acpi.h"
 
 #define SYSFS_PATH "/sys/class/power_supply"
+#define THERMAL_PATH "/sys/class/thermal"
 #define ACPI_MAXITEM 8
 
 int acpi_batt_count = 0;
@@ -33,6 +36,17 @@ int acpi_ac_count = 0;
 char acpi_ac_adapter_info[ACPI_MAXITEM][128];
 char acpi_ac_adapter_status[ACPI_MAXITEM][128];
 
+/* The info files of the batteries and ac adapters are opened when they are
+ * found, and read again with pread into their own buffer. */
+static struct acpi_file acpi_batt_file[ACPI_MAXITEM];
+static struct acpi_file acpi_ac_file[ACPI_MAXITEM];
+
+/* The last known state of the batteries, from their file or a uevent, and
+ * whether the ac adapters are online (-1 until they are read again). */
+static struct acpi_supply_info acpi_batt_supply[ACPI_MAXITEM];
+static unsigned char acpi_batt_cached[ACPI_MAXITEM];
+static int acpi_ac_online[ACPI_MAXITEM];
+
 char *acpi_labels[] = {
 	"uevent",
 	"status",
@@ -56,22 +70,64 @@ char *acpi_labels[] = {
 int acpi_thermal_count = 0;
 char acpi_thermal_info[ACPI_MAXITEM][128];
 char acpi_thermal_status[ACPI_MAXITEM][128];
+/* The temperature files, kept open like the battery files. */
+static struct acpi_file acpi_thermal_file[ACPI_MAXITEM];
 #endif
 
-/* Read in an entire ACPI proc file (well, the first 1024 bytes anyway), and
- * return a statically allocated array containing it. */
-inline char *get_acpi_file (const char *file) {
+/* Read in an entire ACPI proc file (well, the first size bytes anyway) into
+ * buf. Returns buf, or NULL on error. */
+char *get_acpi_file (const char *file, char *buf, size_t size) {
 	int fd;
-	int end;
-	static char buf[1024];
-	fd = open(file, O_RDONLY);
+	ssize_t end;
+	fd = open(file, O_RDONLY | O_CLOEXEC);
 	if (fd == -1) return NULL;
-	end = read(fd, buf, sizeof(buf));
-	buf[end-1] = '\0';
+	end = read(fd, buf, size - 1);
 	close(fd);
+	if (end <= 0) return NULL;
+	buf[end] = '\0';
 	return buf;
 }
 
+void close_acpi_file (struct acpi_file *f) {
+	if (f->fd >= 0)
+		close(f->fd);
+	f->fd = -1;
+}
+
+/* A file which is open already stays open. */
+static int open_acpi_file (struct acpi_file *f, const char *file) {
+	if (f->fd >= 0 && strcmp(f->path, file) == 0)
+		return f->fd;
+	close_acpi_file(f);
+	/* read_acpi_file opens a file again by its own path */
+	if (file != f->path)
+		snprintf(f->path, sizeof(f->path), "%s", file);
+	f->fd = open(f->path, O_RDONLY | O_CLOEXEC);
+	return f->fd;
+}
+
+/* Read an open ACPI file again into its buffer, which is returned. The file
+ * is opened again if the device went away (a battery was swapped). Returns
+ * NULL on error. */
+char *read_acpi_file (struct acpi_file *f) {
+	ssize_t end;
+	int retry;
+
+	for (retry = 0; retry < 2; retry++) {
+		if (f->fd < 0 && open_acpi_file(f, f->path) < 0)
+			return NULL;
+		end = pread(f->fd, f->buf, sizeof(f->buf) - 1, 0);
+		if (end > 0) {
+			f->buf[end] = '\0';
+			return f->buf;
+		}
+		if (end < 0 && errno != ENODEV)
+			return NULL;
+		close_acpi_file(f);
+	}
+	return NULL;
+}
+
 int strmcmp(const char *s1, const char *s2)
 {
 	for (; (*s1 == *s2) || (*s2 == '?'); s1++, s2++) {
@@ -133,27 +189,161 @@ inline char *scan_acpi_value (const char *buf, const char *key) {
 	return NULL;
 }
 
+/* The keys of parse_acpi_supply, after POWER_SUPPLY_. */
+enum acpi_supply_key {
+	supply_none,
+	supply_present,
+	supply_online,
+	supply_status,
+	supply_capacity,
+	supply_charge_now,
+	supply_energy_now,
+	supply_charge_full,
+	supply_energy_full,
+	supply_charge_full_design,
+	supply_energy_full_design,
+	supply_current_now,
+	supply_power_now,
+	supply_voltage_now,
+	supply_scope,
+};
+
+/* A perfect hash of the keys: their length, first and last character are
+ * enough to tell them apart. The table is laid out by the compiler, two keys
+ * hashing to the same slot would override each other (-Woverride-init). */
+#define SUPPLY_HASH_SIZE 32
+#define SUPPLY_HASH(len, first, last) (((len) + 2 * ((first) + (last))) & (SUPPLY_HASH_SIZE - 1))
+#define SUPPLY_KEY(name, first, last, key) \
+	[SUPPLY_HASH(sizeof(name) - 1, first, last)] = { name, sizeof(name) - 1, key }
+
+static const struct {
+	const char *name;
+	size_t len;
+	enum acpi_supply_key key;
+} acpi_supply_keys[SUPPLY_HASH_SIZE] = {
+	SUPPLY_KEY("PRESENT", 'P', 'T', supply_present),
+	SUPPLY_KEY("ONLINE", 'O', 'E', supply_online),
+	SUPPLY_KEY("STATUS", 'S', 'S', supply_status),
+	SUPPLY_KEY("CAPACITY", 'C', 'Y', supply_capacity),
+	SUPPLY_KEY("CHARGE_NOW", 'C', 'W', supply_charge_now),
+	SUPPLY_KEY("ENERGY_NOW", 'E', 'W', supply_energy_now),
+	SUPPLY_KEY("CHARGE_FULL", 'C', 'L', supply_charge_full),
+	SUPPLY_KEY("ENERGY_FULL", 'E', 'L', supply_energy_full),
+	SUPPLY_KEY("CHARGE_FULL_DESIGN", 'C', 'N', supply_charge_full_design),
+	SUPPLY_KEY("ENERGY_FULL_DESIGN", 'E', 'N', supply_energy_full_design),
+	SUPPLY_KEY("CURRENT_NOW", 'C', 'W', supply_current_now),
+	SUPPLY_KEY("POWER_NOW", 'P', 'W', supply_power_now),
+	SUPPLY_KEY("VOLTAGE_NOW", 'V', 'W', supply_voltage_now),
+	SUPPLY_KEY("SCOPE", 'S', 'E', supply_scope),
+};
+
+static void clear_acpi_supply (struct acpi_supply_info *info) {
+	info->present = info->online = info->capacity = -1;
+	info->now = info->full = info->full_design = -1;
+	info->current_now = info->power_now = info->voltage_now = -1;
+	info->energy = 0;
+	info->device_scope = 0;
+	info->status[0] = '\0';
+}
+
+/* One "POWER_SUPPLY_KEY=value" line, up to end. */
+static void parse_supply_line (const char *line, const char *end, struct acpi_supply_info *info) {
+	static const char prefix[] = "POWER_SUPPLY_";
+	enum acpi_supply_key key = supply_none;
+	const char *eq;
+	long long val;
+	size_t len;
+	int h;
+
+	if ((size_t)(end - line) <= sizeof(prefix) - 1 ||
+	    strncmp(line, prefix, sizeof(prefix) - 1) != 0)
+		return;
+	line += sizeof(prefix) - 1;
+	eq = memchr(line, '=', end - line);
+	if (!eq || eq == line)
+		return;
+	len = eq - line;
+	h = SUPPLY_HASH(len, line[0], line[len - 1]);
+	if (acpi_supply_keys[h].len == len &&
+	    memcmp(acpi_supply_keys[h].name, line, len) == 0)
+		key = acpi_supply_keys[h].key;
+	if (key == supply_none)
+		return;
+	if (key == supply_status) {
+		len = end - eq - 1;
+		if (len >= sizeof(info->status))
+			len = sizeof(info->status) - 1;
+		memcpy(info->status, eq + 1, len);
+		info->status[len] = '\0';
+		return;
+	}
+	if (key == supply_scope) {
+		info->device_scope = end - eq - 1 == 6 && memcmp(eq + 1, "Device", 6) == 0;
+		return;
+	}
+	val = strtoll(eq + 1, NULL, 10);
+	switch (key) {
+		case supply_present: info->present = val; break;
+		case supply_online: info->online = val; break;
+		case supply_capacity: info->capacity = val; break;
+		case supply_energy_now: info->energy = 1; /* fall through */
+		case supply_charge_now: info->now = val; break;
+		case supply_energy_full: info->energy = 1; /* fall through */
+		case supply_charge_full: info->full = val; break;
+		case supply_energy_full_design: info->energy = 1; /* fall through */
+		case supply_charge_full_design: info->full_design = val; break;
+		case supply_current_now: info->current_now = val; break;
+		case supply_power_now: info->power_now = val; break;
+		case supply_voltage_now: info->voltage_now = val; break;
+		default: break;
+	}
+}
+
+/* Fill info from a buffer holding a power supply uevent file, in a single
+ * pass over it. */
+void parse_acpi_supply (const char *buf, struct acpi_supply_info *info) {
+	const char *line, *end;
+
+	clear_acpi_supply(info);
+	for (line = buf; *line; line = *end ? end + 1 : end) {
+		end = strchr(line, '\n');
+		if (!end)
+			end = line + strlen(line);
+		parse_supply_line(line, end, info);
+	}
+}
+
+/* The same for the NUL separated KEY=value pairs of a uevent, which carries
+ * the same keys as the file. */
+void parse_acpi_uevent (const char *msg, size_t len, struct acpi_supply_info *info) {
+	const char *line, *end = msg + len;
+
+	clear_acpi_supply(info);
+	for (line = msg; line < end; line += strnlen(line, end - line) + 1)
+		parse_supply_line(line, line + strnlen(line, end - line), info);
+}
+
 /* Read an ACPI proc file, pull out the requested piece of information, and
  * return it (statically allocated string). Returns NULL on error, This is 
  * the slow, dumb way, fine for initialization or if only one value is needed
  * from a file, slow if called many times. */
 char *get_acpi_value (const char *file, const char *key) {
-	char *buf = get_acpi_file(file);
-	if (! buf) return NULL;
+	char buf[1024];
+	if (! get_acpi_file(file, buf, sizeof(buf))) return NULL;
 	return scan_acpi_value(buf, key);
 }
 
 /* Returns the last full charge capacity of a battery.
  */
 int get_acpi_batt_capacity(int battery) {
-	char *s;
+	struct acpi_supply_info supply;
+	char *buf;
 
-	s = get_acpi_value(acpi_batt_info[battery], acpi_labels[label_last_full_capacity]);
-	if (s == NULL) {
+	buf = read_acpi_file(&acpi_batt_file[battery]);
+	if (buf == NULL)
 		return 0;
-	} else {
-		return atoi(s);
-	}
+	parse_acpi_supply(buf, &supply);
+	return supply.full > 0 ? supply.full : 0;
 }
 
 /* Comparison function for qsort. */
@@ -164,10 +354,12 @@ int _acpi_compare_strings (const void *a, const void *b) {
 }
 
 /* Find something (batteries, ac adpaters, etc), and set up a string array
- * to hold the paths to info and status files of the things found.
- * Returns the number of items found. */
+ * to hold the paths to info and status files of the things found. If files
+ * is not NULL, the info files are opened as well. Returns the number of
+ * items found. */
 int find_items (char *itemname, char infoarray[ACPI_MAXITEM][128],
-		                char statusarray[ACPI_MAXITEM][128]) {
+		                char statusarray[ACPI_MAXITEM][128],
+		                struct acpi_file files[ACPI_MAXITEM]) {
 	DIR *dir;
 	struct dirent *ent;
 	int num_devices = 0;
@@ -214,10 +406,17 @@ int find_items (char *itemname, char infoarray[ACPI_MAXITEM][128],
 				acpi_labels[label_info]);
 			snprintf(statusarray[i], sizeof(statusarray[i]), SYSFS_PATH "/%s/%s", devices[i],
 				acpi_labels[label_status]);
+			if (files)
+				open_acpi_file(&files[i], infoarray[i]);
 			free(devices[i]);
 		}
 	}
 	free(devices);
+	if (files) {
+		/* the items which are gone */
+		for (i = num_devices; i < ACPI_MAXITEM; i++)
+			close_acpi_file(&files[i]);
+	}
 
 	return num_devices;
 }
@@ -225,7 +424,9 @@ int find_items (char *itemname, char infoarray[ACPI_MAXITEM][128],
 /* Find batteries, return the number, and set acpi_batt_count to it as well. */
 int find_batteries(void) {
 	int i;
-	acpi_batt_count = find_items(acpi_labels[label_battery], acpi_batt_info, acpi_batt_status);
+	acpi_batt_count = find_items(acpi_labels[label_battery], acpi_batt_info, acpi_batt_status, acpi_batt_file);
+	for (i = 0; i < ACPI_MAXITEM; i++)
+		acpi_batt_cached[i] = 0;
 	for (i = 0; i < acpi_batt_count; i++)
 		acpi_batt_capacity[i] = get_acpi_batt_capacity(i);
 	return acpi_batt_count;
@@ -234,36 +435,160 @@ int find_batteries(void) {
 /* Find AC power adapters, return the number found, and set acpi_ac_count to it
  * as well. */
 int find_ac_adapters(void) {
-	acpi_ac_count = find_items(acpi_labels[label_ac_adapter], acpi_ac_adapter_info, acpi_ac_adapter_status);
+	int i;
+	acpi_ac_count = find_items(acpi_labels[label_ac_adapter], acpi_ac_adapter_info, acpi_ac_adapter_status, acpi_ac_file);
+	for (i = 0; i < ACPI_MAXITEM; i++)
+		acpi_ac_online[i] = -1;
 	return acpi_ac_count;
 }
 
 #if ACPI_THERMAL
 /* Find thermal information sources, return the number found, and set
- * thermal_count to it as well. */
+ * thermal_count to it as well. They are thermal zones in their own class,
+ * the info file of a zone is its type and the status file its temperature,
+ * which is opened as well. */
 int find_thermal(void) {
-	acpi_thermal_count = find_items(acpi_labels[label_thermal], acpi_thermal_info, acpi_thermal_status);
+	static int initialized = 0;
+	DIR *dir;
+	struct dirent *ent;
+	char *zones[ACPI_MAXITEM];
+	size_t len = strlen(acpi_labels[label_thermal]);
+	int num_zones = 0;
+	int i;
+
+	if (!initialized) {
+		for (i = 0; i < ACPI_MAXITEM; i++)
+			acpi_thermal_file[i].fd = -1;
+		initialized = 1;
+	}
+
+	dir = opendir(THERMAL_PATH);
+	if (dir != NULL) {
+		while ((ent = readdir(dir)) && num_zones < ACPI_MAXITEM) {
+			if (strncmp(ent->d_name, acpi_labels[label_thermal], len) != 0)
+				continue;
+			zones[num_zones] = strdup(ent->d_name);
+			if (zones[num_zones])
+				num_zones++;
+		}
+		closedir(dir);
+	}
+	qsort(zones, num_zones, sizeof(char *), _acpi_compare_strings);
+
+	for (i = 0; i < num_zones; i++) {
+		snprintf(acpi_thermal_info[i], sizeof(acpi_thermal_info[i]), THERMAL_PATH "/%s/type", zones[i]);
+		snprintf(acpi_thermal_status[i], sizeof(acpi_thermal_status[i]), THERMAL_PATH "/%s/temp", zones[i]);
+		open_acpi_file(&acpi_thermal_file[i], acpi_thermal_status[i]);
+		free(zones[i]);
+	}
+	for (i = num_zones; i < ACPI_MAXITEM; i++)
+		close_acpi_file(&acpi_thermal_file[i]);
+
+	acpi_thermal_count = num_zones;
 	return acpi_thermal_count;
 }
+
+/* Temperature of a thermal zone in millidegrees Celsius. Call find_thermal
+ * first. Returns -1 on error. */
+int read_acpi_thermal (int zone, int *temp) {
+	char *buf = read_acpi_file(&acpi_thermal_file[zone]);
+	char *end;
+
+	if (buf == NULL)
+		return -1;
+	*temp = strtol(buf, &end, 10);
+	return end == buf ? -1 : 0;
+}
+
+/* Close the temperature files of find_thermal. */
+void close_acpi_thermal (void) {
+	int i;
+
+	for (i = 0; i < acpi_thermal_count; i++)
+		close_acpi_file(&acpi_thermal_file[i]);
+	acpi_thermal_count = 0;
+}
 #endif
 
-/* Returns true if the system is on ac power. Call find_ac_adapters first. */
+/* Returns true if the system is on ac power. Call find_ac_adapters first.
+ * Only the adapters whose state is not known are read. */
 int on_ac_power (void) {
 	int i;
 	for (i = 0; i < acpi_ac_count; i++) {
-		char *online=get_acpi_value(acpi_ac_adapter_info[i], acpi_labels[label_ac_state]);
-		if (online && atoi(online))
+		if (acpi_ac_online[i] < 0) {
+			struct acpi_supply_info supply;
+			char *buf = read_acpi_file(&acpi_ac_file[i]);
+			if (!buf)
+				continue;
+			parse_acpi_supply(buf, &supply);
+			acpi_ac_online[i] = supply.online > 0;
+		}
+		if (acpi_ac_online[i])
 			return 1;
 	}
 	return 0;
 }
 
+/* Which of the items is the power supply called name, -1 if none. */
+static int find_item (char infoarray[ACPI_MAXITEM][128], int count, const char *name) {
+	size_t len = strlen(name);
+	int i;
+	for (i = 0; i < count; i++) {
+		/* SYSFS_PATH/name/uevent */
+		const char *p = infoarray[i] + sizeof(SYSFS_PATH);
+		if (strncmp(p, name, len) == 0 && p[len] == '/')
+			return i;
+	}
+	return -1;
+}
+
+/* Update the known state from a power_supply uevent of the device called
+ * name; msg holds its NUL separated KEY=value pairs. A change event carries
+ * all of the values, so nothing has to be read. When a device comes or goes,
+ * only its kind is looked for again; the files of the other devices stay
+ * open. Returns 1 if a battery or ac adapter changed. */
+int acpi_supply_event (const char *action, const char *name, const char *msg, size_t len) {
+	struct acpi_supply_info supply;
+	int i;
+
+	if (strcmp(action, "add") == 0 || strcmp(action, "remove") == 0) {
+		int batt = find_item(acpi_batt_info, acpi_batt_count, name) >= 0;
+		int ac = find_item(acpi_ac_adapter_info, acpi_ac_count, name) >= 0;
+		if (!batt && !ac && action[0] == 'a') {
+			char file[128], buf[32];
+			snprintf(file, sizeof(file), SYSFS_PATH "/%s/type", name);
+			if (get_acpi_file(file, buf, sizeof(buf))) {
+				batt = strstr(buf, acpi_labels[label_battery]) == buf;
+				ac = strstr(buf, acpi_labels[label_ac_adapter]) == buf;
+			}
+		}
+		if (batt)
+			find_batteries();
+		if (ac)
+			find_ac_adapters();
+		return batt || ac;
+	}
+	if (strcmp(action, "change") != 0)
+		return 0;
+	if ((i = find_item(acpi_batt_info, acpi_batt_count, name)) >= 0) {
+		parse_acpi_uevent(msg, len, &acpi_batt_supply[i]);
+		acpi_batt_cached[i] = 1;
+		return 1;
+	}
+	if ((i = find_item(acpi_ac_adapter_info, acpi_ac_count, name)) >= 0) {
+		parse_acpi_uevent(msg, len, &supply);
+		acpi_ac_online[i] = supply.online > 0;
+		return 1;
+	}
+	return 0;
+}
+
 /* See if we have ACPI support and check version. Also find batteries and
  * ac power adapters. */
 int acpi_supported (void) {
-	char *version;
+	char *version, buf[64];
 	DIR *dir;
-	int num;
+	int num, i;
 
 	if (!(dir = opendir(SYSFS_PATH))) {
 		return 0;
@@ -273,7 +598,7 @@ int acpi_supported (void) {
 	/* If kernel is 2.6.21 or newer, version is in
 	   /sys/module/acpi/parameters/acpica_version */
 	
-	version = get_acpi_file("/sys/module/acpi/parameters/acpica_version");
+	version = get_acpi_file("/sys/module/acpi/parameters/acpica_version", buf, sizeof(buf));
 	if (version == NULL) {
 		return 0;
 	}
@@ -284,20 +609,20 @@ int acpi_supported (void) {
 		return 0;
 	}
 	
+	for (i = 0; i < ACPI_MAXITEM; i++)
+		acpi_batt_file[i].fd = acpi_ac_file[i].fd = -1;
 	find_batteries();
 	find_ac_adapters();
-#if ACPI_THERMAL
-	find_thermal();
-#endif
 	
 	return 1;
 }
 
 #ifdef ACPI_APM
-/* Read ACPI info on a given power adapter and battery, and fill the passed
- * apm_info struct. */
-int acpi_read (int battery, apm_info *info) {
-	char *buf, *state;
+/* Fill the passed apm_info struct from the known state of a battery and the
+ * ac adapters. */
+static int acpi_fill (int battery, apm_info *info) {
+	struct acpi_supply_info supply;
+	char *state;
 	
 	if (acpi_batt_count == 0) {
 		info->battery_percentage = 0;
@@ -312,12 +637,8 @@ int acpi_read (int battery, apm_info *info) {
 	/* Internally it's zero indexed. */
 	battery--;
 	
-	buf = get_acpi_file(acpi_batt_info[battery]);
-	if (buf == NULL) {
-		fprintf(stderr, "acpi: unable to read %s\n", acpi_batt_info[battery]);
-		perror("read");
-		exit(1);
-	}
+	/* a copy, find_batteries below forgets it */
+	supply = acpi_batt_supply[battery];
 
 	info->ac_line_status = 0;
 	info->battery_flags = 0;
@@ -325,16 +646,18 @@ int acpi_read (int battery, apm_info *info) {
 	
 	/* Work out if the battery is present, and what percentage of full
 	 * it is and how much time is left. */
-	if (strcmp(scan_acpi_value(buf, acpi_labels[label_present]), "1") == 0) {
-		int pcap = scan_acpi_num(buf, acpi_labels[label_remaining_capacity]);
-		int rate = scan_acpi_num(buf, acpi_labels[label_present_rate]);
-		if (rate) {
+	if (supply.present == 1) {
+		long long pcap = supply.now > 0 ? supply.now : 0;
+		/* in the unit of the capacity: uW for uWh, uA for uAh */
+		long long rate = supply.energy ? supply.power_now : supply.current_now;
+		if (rate < 0 && supply.energy && supply.current_now >= 0 && supply.voltage_now > 0)
+			rate = supply.current_now * supply.voltage_now / 1000000;
+		if (rate > 0) {
 			/* time remaining = (current_capacity / discharge rate) */
 			info->battery_time = (float) pcap / (float) rate * 60;
 		}
 		else {
-			char *rate_s = scan_acpi_value(buf, acpi_labels[label_present_rate]);
-			if (! rate_s) {
+			if (rate < 0) {
 				/* Time remaining unknown. */
 				info->battery_time = 0;
 			}
@@ -346,8 +669,8 @@ int acpi_read (int battery, apm_info *info) {
 			}
 		}
 
-		state = scan_acpi_value(buf, acpi_labels[label_charging_state]);
-		if (state) {
+		state = supply.status;
+		if (state[0]) {
 			if (state[0] == 'D') { /* discharging */
 				info->battery_status = BATTERY_STATUS_CHARGING;
 				/* Expensive ac power check used here
@@ -359,7 +682,7 @@ int acpi_read (int battery, apm_info *info) {
 				info->battery_status = BATTERY_STATUS_CHARGING;
 				info->ac_line_status = 1;
 				info->battery_flags = info->battery_flags | BATTERY_FLAGS_CHARGING;
-				if (rate)
+				if (rate > 0)
 					info->battery_time = -1 * (float) (acpi_batt_capacity[battery] - pcap) / (float) rate * 60;
 				else
 					info->battery_time = 0;
@@ -380,9 +703,8 @@ int acpi_read (int battery, apm_info *info) {
 			}
 			else if (state[0] == 'U') { /* unknown */
 				info->ac_line_status = on_ac_power();
-				int current = scan_acpi_num(buf, acpi_labels[label_present_rate]);
 				if (info->ac_line_status) {
-					if (current == 0)
+					if (rate <= 0)
 						info->battery_status = BATTERY_STATUS_HIGH;
 					else
 						info->battery_status = BATTERY_STATUS_CHARGING;
@@ -404,8 +726,6 @@ int acpi_read (int battery, apm_info *info) {
 			/* The battery was absent, and now is present.
 			 * Well, it might be a different battery. So
 			 * re-probe the battery. */
-			/* NOTE that this invalidates buf. No accesses of
-			 * buf below this point! */
 			acpi_batt_capacity[battery] = get_acpi_batt_capacity(battery);
 		}
 		else if (pcap > acpi_batt_capacity[battery]) {
@@ -414,7 +734,11 @@ int acpi_read (int battery, apm_info *info) {
 			find_batteries();
 		}
 
-		if (pcap && acpi_batt_capacity[battery]) {
+		if (supply.capacity >= 0) {
+			/* the kernel knows best */
+			info->battery_percentage = supply.capacity > 100 ? 100 : supply.capacity;
+		}
+		else if (pcap && acpi_batt_capacity[battery]) {
 			info->battery_percentage = (long) 100 * pcap / acpi_batt_capacity[battery];
 			if (info->battery_percentage > 100)
 				info->battery_percentage = 100;
@@ -441,4 +765,147 @@ int acpi_read (int battery, apm_info *info) {
 	
 	return 0;
 }
+
+/* Read ACPI info on a given power adapter and battery, and fill the passed
+ * apm_info struct. Returns -1 if the battery cannot be read (it went away),
+ * the batteries are looked up again then and info is not filled. */
+int acpi_read (int battery, apm_info *info) {
+	char *buf;
+	int i;
+
+	if (acpi_batt_count > 0) {
+		buf = read_acpi_file(&acpi_batt_file[battery - 1]);
+		if (buf == NULL) {
+			syslog(LOG_WARNING, "acpi: unable to read %s: %s", acpi_batt_info[battery - 1], strerror(errno));
+			find_batteries();
+			return -1;
+		}
+		parse_acpi_supply(buf, &acpi_batt_supply[battery - 1]);
+		acpi_batt_cached[battery - 1] = 1;
+	}
+	/* the ac adapters as well, when they are needed */
+	for (i = 0; i < acpi_ac_count; i++)
+		acpi_ac_online[i] = -1;
+	return acpi_fill(battery, info);
+}
+
+/* Like acpi_read, but only reads what is not known from uevents. */
+int acpi_read_cached (int battery, apm_info *info) {
+	if (acpi_batt_count > 0 && !acpi_batt_cached[battery - 1])
+		return acpi_read(battery, info);
+	return acpi_fill(battery, info);
+}
+
+/* Energy in uWh of a battery's charge or energy value, -1 if unknown. */
+static long long supply_energy (const struct acpi_supply_info *s, long long val) {
+	if (val < 0)
+		return -1;
+	if (s->energy)
+		return val;
+	if (s->voltage_now > 0)
+		return val * s->voltage_now / 1000000;
+	return -1;
+}
+
+/* Power in uW drawn from a battery, -1 if unknown. Some report it negative
+ * while discharging. */
+static long long supply_power (const struct acpi_supply_info *s) {
+	if (s->power_now != -1)
+		return llabs(s->power_now);
+	if (s->current_now != -1 && s->voltage_now > 0)
+		return llabs(s->current_now) * s->voltage_now / 1000000;
+	return -1;
+}
+
+/* See acpi_read_batteries. A battery which cannot be read makes the
+ * batteries looked up again and they are read from the start; if one
+ * cannot be read after that either, it is left out. */
+static int read_batteries (int cached, int rescanned, apm_info *info, struct acpi_batt_total *total) {
+	long long energy = 0, full = 0, weighted = 0, weight = 0, power = 0;
+	int present = 0, system = 0, known = 1, weights_known = 1, power_known = 1;
+	apm_info one;
+	int i, ret;
+
+	total->energy = total->full = total->power = -1;
+	if (acpi_batt_count == 0)
+		return acpi_read(1, info);
+	for (i = 0; i < acpi_batt_count; i++) {
+		const struct acpi_supply_info *s = &acpi_batt_supply[i];
+		long long e, f, p;
+
+		if (cached)
+			ret = acpi_read_cached(i + 1, &one);
+		else
+			ret = acpi_read(i + 1, &one);
+		if (ret < 0 && !rescanned)
+			return read_batteries(cached, 1, info, total);
+		if (ret < 0 || s->device_scope)
+			continue;
+		if (system++ == 0)
+			*info = one;
+		if (one.ac_line_status == 1)
+			info->ac_line_status = 1;
+		if (one.battery_status == BATTERY_STATUS_ABSENT)
+			continue;
+		if (present == 0 || one.battery_status == BATTERY_STATUS_CRITICAL)
+			info->battery_status = one.battery_status;
+		info->battery_flags |= one.battery_flags;
+		present++;
+		e = supply_energy(s, s->now);
+		f = supply_energy(s, s->full > 0 ? s->full : acpi_batt_capacity[i]);
+		if (f > 0 && one.battery_percentage >= 0) {
+			/* the kernel's capacity, see acpi_fill */
+			weighted += one.battery_percentage * f;
+			weight += f;
+		}
+		else {
+			weights_known = 0;
+		}
+		if (e >= 0 && f > 0) {
+			energy += e;
+			full += f;
+		}
+		else {
+			known = 0;
+		}
+		if (s->status[0] == 'D') {
+			if ((p = supply_power(s)) >= 0)
+				power += p;
+			else
+				power_known = 0;
+		}
+	}
+	if (system == 0) {
+		/* Where else would the power come from, eh? ;-) */
+		info->battery_percentage = 0;
+		info->battery_time = 0;
+		info->battery_status = BATTERY_STATUS_ABSENT;
+		info->ac_line_status = 1;
+		return 0;
+	}
+	if (present > 1) {
+		/* Without the energies they cannot be weighed. */
+		info->battery_percentage = weights_known ? weighted / weight : -1;
+	}
+	if (present > 0 && known) {
+		total->energy = energy;
+		total->full = full;
+		if (power_known) {
+			total->power = power;
+			if (power > 0)
+				info->battery_time = energy * 60 / power;
+		}
+	}
+	return 0;
+}
+
+/* Read all batteries into info as if they were one: the percentage each
+ * battery reports is weighted by its energy when full, so a small external
+ * pack counts less than a big internal one. Batteries of devices (a mouse,
+ * a keyboard) do not power the system and are left out. total gets the
+ * energy in them and the power drawn from them (-1 if a battery does not
+ * tell). With cached set, only what uevents did not tell is read. */
+int acpi_read_batteries (int cached, apm_info *info, struct acpi_batt_total *total) {
+	return read_batteries(cached, 0, info, total);
+}
 #endif
@@ -4,7 +4,7 @@
 
 /* Define ACPI_THERMAL to make the library support finding info about thermal
  * sources. */
-/* #define ACPI_THERMAL 1 */
+#define ACPI_THERMAL 1
 
 /* Define ACPI_APM to get the acpi_read function, which is like apm_read. */
 /* #define ACPI_APM 1 */
@@ -15,12 +15,50 @@
 /* The number of acpi items of each class supported. */
 #define ACPI_MAXITEM 8
 
+/* A file which is kept open and read with pread into its own buffer. */
+struct acpi_file {
+	char path[128];
+	int fd;
+	char buf[1024];
+};
+
+/* The POWER_SUPPLY_* values of a power supply uevent file. Numbers which
+ * are not in the file are -1, a missing status is empty. */
+struct acpi_supply_info {
+	int present;
+	int online;
+	int capacity;		/* percent */
+	long long now;		/* charge (uAh) or energy (uWh) */
+	long long full;
+	long long full_design;
+	unsigned char energy;	/* now and full are energies */
+	long long current_now;	/* uA */
+	long long power_now;	/* uW */
+	long long voltage_now;	/* uV */
+	unsigned char device_scope;	/* of a device (a mouse), not the system */
+	char status[16];
+};
+
+/* All batteries together, -1 if not known. */
+struct acpi_batt_total {
+	long long energy;	/* uWh */
+	long long full;		/* uWh */
+	long long power;	/* uW drawn while discharging */
+};
+
 int acpi_supported (void);
 #ifdef ACPI_APM
 int acpi_read (int battery, apm_info *info);
+int acpi_read_cached (int battery, apm_info *info);
+int acpi_read_batteries (int cached, apm_info *info, struct acpi_batt_total *total);
 #endif
-char *get_acpi_file (const char *file);
+int acpi_supply_event (const char *action, const char *name, const char *msg, size_t len);
+char *get_acpi_file (const char *file, char *buf, size_t size);
+char *read_acpi_file (struct acpi_file *f);
+void close_acpi_file (struct acpi_file *f);
 int scan_acpi_num (const char *buf, const char *key);
+void parse_acpi_supply (const char *buf, struct acpi_supply_info *info);
+void parse_acpi_uevent (const char *msg, size_t len, struct acpi_supply_info *info);
 char *scan_acpi_value (const char *buf, const char *key);
 char *get_acpi_value (const char *file, const char *key);
 int get_acpi_batt_capacity(int battery);
@@ -38,6 +76,10 @@ extern char acpi_ac_adapter_info[ACPI_MAXITEM][128];
 extern char acpi_ac_adapter_status[ACPI_MAXITEM][128];
 
 #if ACPI_THERMAL
+int find_thermal (void);
+int read_acpi_thermal (int zone, int *temp);
+void close_acpi_thermal (void);
+
 extern int acpi_thermal_count;
 extern char acpi_thermal_info[ACPI_MAXITEM][128];
 extern char acpi_thermal_status[ACPI_MAXITEM][128];
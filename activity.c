@@ -0,0 +1,209 @@
+/*
+ * Activity source registry for sleepd
+ *
+ * Every way of detecting activity (interrupts, network, input events, ...)
+ * is an activity_source. A source is polled by the scheduler, sampled when
+ * the idle time gets evaluated, or driven by an fd on the reactor. Whatever
+ * it is, it keeps the time of its last activity; the idle time is the
+ * distance to the newest of them.
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+
+#include "reactor.h"
+#include "sched.h"
+#include "activity.h"
+
+#define container_of(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+
+static struct activity_source *sources[ACT_MAXSOURCES];
+static int nsources = 0;
+
+
+/* Before parsing the command line, so --period can find it. */
+int activity_register (struct activity_source *src) {
+	if (!src || !src->sample || nsources >= ACT_MAXSOURCES)
+		return -1;
+	/* defaults filled in by activity_init */
+	src->task.period = 0;
+	src->task.jitter = -1;
+	src->task.idx = -1;
+	src->enabled = 0;
+	sources[nsources++] = src;
+	return 0;
+}
+
+struct activity_source *activity_find (const char *name, size_t len) {
+	int i;
+
+	for (i = 0; i < nsources; i++) {
+		if (strlen(sources[i]->name) == len &&
+		    strncmp(sources[i]->name, name, len) == 0)
+			return sources[i];
+	}
+	return NULL;
+}
+
+static void mark (struct activity_source *src, int hit, long long now) {
+	if (hit > 0 && src->last_active < now)
+		src->last_active = now;
+}
+
+static int task_run (struct sched_task *t, long long now) {
+	struct activity_source *src = container_of(t, struct activity_source, task);
+	int hit = src->sample(src, now, 0);
+
+	mark(src, hit, now);
+	return hit > 0;
+}
+
+static void task_baseline (struct sched_task *t, long long now) {
+	struct activity_source *src = container_of(t, struct activity_source, task);
+
+	src->sample(src, now, 1);
+}
+
+static void fd_cb (int fd, unsigned int events, void *arg) {
+	struct activity_source *src = arg;
+	long long now = sched_now();
+
+	mark(src, src->sample(src, now, 0), now);
+}
+
+/* Initialize all registered sources, schedule the polled ones (period is
+ * their default period in ms) and watch the fds of the others. Sources which
+ * only count towards the idle limits are left out without idle_checks.
+ * Returns the number of enabled sources. */
+int activity_init (int idle_checks, long long period) {
+	long long now = sched_now();
+	int i, n = 0;
+
+	for (i = 0; i < nsources; i++) {
+		struct activity_source *src = sources[i];
+		int fd;
+
+		if (!idle_checks && (src->flags & ACT_IDLE))
+			continue;
+		if (src->init && src->init(src) != 1)
+			continue;
+		src->enabled = 1;
+		src->last_active = 0;
+		n++;
+
+		if (src->fd && (fd = src->fd(src)) >= 0) {
+			if (reactor_add(fd, EPOLLIN, fd_cb, src) != 0)
+				fprintf(stderr, "sleepd: %s: unable to watch fd %d\n", src->name, fd);
+		}
+
+		if (src->flags & ACT_POLLED) {
+			struct sched_task *t = &src->task;
+			t->name = src->name;
+			t->run = task_run;
+			t->baseline = (src->flags & ACT_BASELINE) ? task_baseline : NULL;
+			t->flags = (src->flags & ACT_OWNLIMIT) ? 0 : SCHED_ACTIVITY;
+			if (t->period == 0)
+				t->period = period;
+			if (t->jitter < 0)
+				t->jitter = t->period / 10;
+			if (src->cost)
+				t->cost = src->cost(src);
+			if (debug)
+				printf("sleepd: %s: period %lldms, jitter %lldms\n", t->name, t->period, t->jitter);
+			if (sched_add(t, now) != 0) {
+				fprintf(stderr, "sleepd: unable to schedule %s\n", t->name);
+				return -1;
+			}
+		}
+		else if (debug) {
+			printf("sleepd: %s: enabled\n", src->name);
+		}
+	}
+	return n;
+}
+
+void activity_teardown (void) {
+	int i;
+
+	for (i = 0; i < nsources; i++) {
+		struct activity_source *src = sources[i];
+		if (!src->enabled)
+			continue;
+		if (src->fd && src->fd(src) >= 0)
+			reactor_del(src->fd(src));
+		if (src->teardown)
+			src->teardown(src);
+		src->enabled = 0;
+	}
+}
+
+/* Sources which know their last activity themselves (utmp, X11) are only
+ * sampled right before it matters. */
+void activity_sample_deferred (long long now) {
+	int i;
+
+	for (i = 0; i < nsources; i++) {
+		struct activity_source *src = sources[i];
+		if (src->enabled && (src->flags & ACT_DEFERRED))
+			mark(src, src->sample(src, now, 0), now);
+	}
+}
+
+/* Newest activity of all sources, 0 if none. */
+long long activity_last (const char **name) {
+	long long last = 0;
+	int i;
+
+	for (i = 0; i < nsources; i++) {
+		struct activity_source *src = sources[i];
+		if (src->enabled && !(src->flags & ACT_OWNLIMIT) &&
+		    src->last_active > last) {
+			last = src->last_active;
+			if (name)
+				*name = src->name;
+		}
+	}
+	return last;
+}
+
+void activity_reset (long long now) {
+	int i;
+
+	for (i = 0; i < nsources; i++)
+		sources[i]->last_active = now;
+}
+
+/* Sources which only count towards the idle limits are not sampled while
+ * there is none (e.g. on AC power without -U). */
+void activity_park (int idle_needed, long long now) {
+	int i;
+
+	for (i = 0; i < nsources; i++) {
+		struct sched_task *t = &sources[i]->task;
+		if (!(sources[i]->flags & ACT_IDLE) || t->idx < 0)
+			continue;
+		if (!idle_needed && t->due != SCHED_NEVER) {
+			if (debug)
+				printf("sleepd: %s: parked\n", t->name);
+			sched_set_due(t, SCHED_NEVER);
+		}
+		else if (idle_needed && t->due == SCHED_NEVER) {
+			sched_set_due(t, now);
+		}
+	}
+}
+
+/* Measured cost of the polled sources, see sched_run. */
+void activity_print_costs (void) {
+	int i;
+
+	for (i = 0; i < nsources; i++) {
+		struct sched_task *t = &sources[i]->task;
+		if (sources[i]->enabled && t->idx >= 0 && (t->flags & SCHED_ACTIVITY))
+			printf("sleepd: %s: cost %.1fus, hit rate %.0f%%, %u skipped\n", t->name,
+				t->cost / 1000, t->hit_rate * 100, t->skipped);
+	}
+}
@@ -0,0 +1,55 @@
+/*
+ * Activity source registry for sleepd
+ * (not Threadsafe!)
+ */
+
+#include <stddef.h>
+
+/* needs sched.h */
+
+#define ACT_MAXSOURCES 16
+
+/* source flags */
+#define ACT_POLLED   0x1	/* sampled every task.period */
+#define ACT_DEFERRED 0x2	/* sampled when the idle time gets evaluated */
+#define ACT_IDLE     0x4	/* only counts towards the system idle limits (-u, -U) */
+#define ACT_BASELINE 0x8	/* keeps counters, refreshed when a sample is skipped */
+#define ACT_OWNLIMIT 0x10	/* has its own idle limit (X11 screen diff), not part of activity_last */
+
+struct activity_source
+{
+	const char *name;
+	unsigned int flags;
+
+	/* Returns 1 if the source is enabled, 0 if it is not configured, -1
+	 * on error. */
+	int (*init)(struct activity_source *src);
+	/* Optional, an fd to watch: sample is called when it is readable.
+	 * Returns -1 if there is none. */
+	int (*fd)(struct activity_source *src);
+	/* Returns 1 if activity was seen now. Sources which know when the
+	 * last activity happened may set last_active themselves. With
+	 * baseline set, only counters are refreshed. */
+	int (*sample)(struct activity_source *src, long long now, int baseline);
+	/* Optional, expected cost of a sample in ns until it is measured. */
+	double (*cost)(struct activity_source *src);
+	/* Optional, releases everything init acquired. */
+	void (*teardown)(struct activity_source *src);
+
+	/* managed by the registry */
+	int enabled;
+	long long last_active;	/* CLOCK_MONOTONIC in ms, 0 if none */
+	struct sched_task task;	/* used with ACT_POLLED */
+};
+
+extern unsigned char debug;
+
+extern int activity_register (struct activity_source *src);
+extern struct activity_source *activity_find (const char *name, size_t len);
+extern int activity_init (int idle_checks, long long period);
+extern void activity_teardown (void);
+extern void activity_sample_deferred (long long now);
+extern long long activity_last (const char **name);
+extern void activity_reset (long long now);
+extern void activity_park (int idle_needed, long long now);
+extern void activity_print_costs (void);
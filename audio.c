@@ -0,0 +1,120 @@
+/*
+ * Audio playback activity source for sleepd
+ *
+ * A playback substream in the RUNNING state counts as activity. The status
+ * files of the substreams (see PCM_STATUS) are found once, kept open and
+ * read with pread; sound card uevents trigger looking for them again.
+ */
+
+#include <fcntl.h>
+#include <glob.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sched.h"
+#include "activity.h"
+#include "uevent.h"
+#include "audio.h"
+
+#define PCM_STATUS "/proc/asound/card*/pcm*p/sub*/status"
+#define MAX_SUBSTREAMS 64
+
+static unsigned char use_audio = 0;
+static int fds[MAX_SUBSTREAMS];
+static int nfds = 0;
+static unsigned char need_scan = 1;
+
+
+void audio_enable (void) {
+	use_audio = 1;
+}
+
+static void close_all (void) {
+	int i;
+
+	for (i = 0; i < nfds; i++)
+		close(fds[i]);
+	nfds = 0;
+}
+
+static void scan_substreams (void) {
+	glob_t g;
+	size_t i;
+
+	close_all();
+	need_scan = 0;
+	if (glob(PCM_STATUS, 0, NULL, &g) != 0) {
+		if (debug)
+			printf("sleepd: audio: no playback substreams\n");
+		return;
+	}
+	for (i = 0; i < g.gl_pathc && nfds < MAX_SUBSTREAMS; i++) {
+		int fd = open(g.gl_pathv[i], O_RDONLY | O_CLOEXEC);
+		if (fd >= 0)
+			fds[nfds++] = fd;
+	}
+	globfree(&g);
+	if (debug)
+		printf("sleepd: audio: watching %d playback substreams\n", nfds);
+}
+
+static void audio_uevent (const char *action, const char *subsystem,
+		const char *msg, size_t len, void *arg) {
+	if (strcmp(subsystem, "sound") == 0 &&
+	    (strcmp(action, "add") == 0 || strcmp(action, "remove") == 0))
+		need_scan = 1;
+}
+
+static int audio_init (struct activity_source *src) {
+	if (!use_audio)
+		return 0;
+	need_scan = 1;
+	if (uevent_listen(audio_uevent, NULL) != 0 && debug)
+		printf("sleepd: audio: no hotplug notifications\n");
+	return 1;
+}
+
+static int audio_sample (struct activity_source *src, long long now, int baseline) {
+	/* "closed" or "state: RUNNING" followed by more */
+	static const char running[] = "state: RUNNING";
+	char buf[sizeof(running)];
+	int i;
+
+	if (need_scan)
+		scan_substreams();
+	for (i = 0; i < nfds; i++) {
+		ssize_t len = pread(fds[i], buf, sizeof(buf) - 1, 0);
+		if (len < 0) {
+			/* the card is gone */
+			need_scan = 1;
+			continue;
+		}
+		buf[len] = '\0';
+		if (strcmp(buf, running) == 0) {
+			if (debug)
+				printf("sleepd: activity: audio playback\n");
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void audio_teardown (struct activity_source *src) {
+	uevent_unlisten(audio_uevent, NULL);
+	close_all();
+}
+
+/* One small pread per substream. */
+static double audio_cost (struct activity_source *src) {
+	return 2000.0 * (nfds ? nfds : 1);
+}
+
+struct activity_source audio_source = {
+	.name = "audio",
+	.flags = ACT_POLLED | ACT_IDLE,
+	.init = audio_init,
+	.sample = audio_sample,
+	.cost = audio_cost,
+	.teardown = audio_teardown,
+};
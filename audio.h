@@ -0,0 +1,8 @@
+/*
+ * Audio playback activity source for sleepd
+ * (not Threadsafe!)
+ */
+
+extern struct activity_source audio_source;
+
+extern void audio_enable (void);
@@ -0,0 +1,338 @@
+/*
+ * cgroup v2 workload activity source for sleepd
+ *
+ * Watches a list of cgroups (e.g. system.slice/backup.service): the cpu time
+ * (cpu.stat) or the bytes read and written (io.stat) they used since the
+ * previous sample count as activity above a threshold. The files are kept
+ * open and read with pread. cgroup.events is watched with inotify, a cgroup
+ * without processes is not read at all. A cgroup which does not exist (yet)
+ * is looked for again every sample.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <mntent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#include "sched.h"
+#include "activity.h"
+#include "cgroup.h"
+
+#define MAX_CGROUPS 16
+#define CGROUP_BUFSIZE 8192
+
+struct cgroup_watch
+{
+	char *path;		/* relative to the cgroup2 mount */
+	long long min_cpu;	/* in usec per sample, -1 if not checked */
+	long long min_io;	/* in bytes per sample, -1 if not checked */
+
+	int cpu_fd;		/* -1 while the cgroup does not exist */
+	int io_fd;		/* -1 without the io controller */
+	int events_fd;
+	int wd;
+	unsigned char populated;
+	unsigned char changed;	/* cgroup.events has to be read again */
+	unsigned char have_prev;
+	unsigned long long cpu;
+	unsigned long long io;
+};
+
+static struct cgroup_watch cgroups[MAX_CGROUPS];
+static int ncgroups = 0;
+static char *mountpoint = NULL;
+static int inotify_fd = -1;
+static char *cgroup_buf = NULL;
+
+
+/* "path[,cpu=ms][,io=bytes]", the cpu time defaults to 100ms per sample if
+ * neither is given. Returns -1 on a bad spec. */
+int cgroup_add (const char *spec) {
+	struct cgroup_watch *c;
+	const char *opt;
+	size_t len = strcspn(spec, ",");
+
+	if (ncgroups >= MAX_CGROUPS || len == 0)
+		return -1;
+	c = &cgroups[ncgroups];
+	memset(c, '\0', sizeof(*c));
+	c->min_cpu = c->min_io = -1;
+	c->cpu_fd = c->io_fd = c->events_fd = c->wd = -1;
+
+	for (opt = spec + len; *opt == ','; opt += strcspn(opt + 1, ",") + 1) {
+		char *end;
+		long long val;
+
+		if (strncmp(opt + 1, "cpu=", 4) == 0) {
+			val = strtoll(opt + 5, &end, 10);
+			c->min_cpu = val * 1000;
+		}
+		else if (strncmp(opt + 1, "io=", 3) == 0) {
+			val = strtoll(opt + 4, &end, 10);
+			if (*end == 'k' || *end == 'K')
+				val *= 1024, end++;
+			else if (*end == 'm' || *end == 'M')
+				val *= 1024 * 1024, end++;
+			c->min_io = val;
+		}
+		else {
+			return -1;
+		}
+		if (val < 0 || (*end != ',' && *end != '\0'))
+			return -1;
+	}
+	if (c->min_cpu < 0 && c->min_io < 0)
+		c->min_cpu = 100 * 1000;
+
+	/* relative to the mount, whichever way it was given */
+	while (*spec == '/' && len > 0)
+		spec++, len--;
+	c->path = strndup(spec, len);
+	if (!c->path)
+		return -1;
+	ncgroups++;
+	return 0;
+}
+
+static int find_mountpoint (void) {
+	struct mntent *m;
+	FILE *f = setmntent("/proc/self/mounts", "r");
+
+	if (!f)
+		return -1;
+	while ((m = getmntent(f))) {
+		if (strcmp(m->mnt_type, "cgroup2") == 0) {
+			mountpoint = strdup(m->mnt_dir);
+			break;
+		}
+	}
+	endmntent(f);
+	return mountpoint ? 0 : -1;
+}
+
+static int open_file (struct cgroup_watch *c, const char *file) {
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s/%s/%s", mountpoint, c->path, file);
+	return open(path, O_RDONLY | O_CLOEXEC);
+}
+
+/* Returns the number of bytes read, -1 on error. */
+static ssize_t read_file (int fd) {
+	ssize_t len = pread(fd, cgroup_buf, CGROUP_BUFSIZE - 1, 0);
+
+	if (len < 0)
+		return -1;
+	cgroup_buf[len] = '\0';
+	return len;
+}
+
+static void close_cgroup (struct cgroup_watch *c) {
+	if (c->wd >= 0)
+		inotify_rm_watch(inotify_fd, c->wd);
+	if (c->events_fd >= 0)
+		close(c->events_fd);
+	if (c->io_fd >= 0)
+		close(c->io_fd);
+	if (c->cpu_fd >= 0)
+		close(c->cpu_fd);
+	c->cpu_fd = c->io_fd = c->events_fd = c->wd = -1;
+	c->have_prev = 0;
+}
+
+static int open_cgroup (struct cgroup_watch *c) {
+	char path[PATH_MAX];
+
+	c->cpu_fd = open_file(c, "cpu.stat");
+	if (c->cpu_fd < 0)
+		return -1;
+	if (c->min_io >= 0) {
+		c->io_fd = open_file(c, "io.stat");
+		if (c->io_fd < 0)
+			syslog(LOG_WARNING, "cgroup %s: no io.stat", c->path);
+	}
+	/* Without cgroup.events, the cgroup is read every time. */
+	c->populated = 1;
+	c->changed = 0;
+	c->events_fd = open_file(c, "cgroup.events");
+	if (c->events_fd >= 0 && inotify_fd >= 0) {
+		snprintf(path, sizeof(path), "%s/%s/cgroup.events", mountpoint, c->path);
+		c->wd = inotify_add_watch(inotify_fd, path, IN_MODIFY);
+		c->changed = 1;
+	}
+	if (debug)
+		printf("sleepd: cgroup %s: watched\n", c->path);
+	return 0;
+}
+
+/* Which cgroups were populated or emptied, or removed. */
+static void check_inotify (void) {
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	ssize_t len;
+	char *p;
+	int i;
+
+	if (inotify_fd < 0)
+		return;
+	while ((len = read(inotify_fd, buf, sizeof(buf))) > 0) {
+		for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+			struct inotify_event *ev = (struct inotify_event *)p;
+			for (i = 0; i < ncgroups; i++) {
+				if (cgroups[i].wd != ev->wd)
+					continue;
+				if (ev->mask & IN_IGNORED) {
+					cgroups[i].wd = -1;
+					close_cgroup(&cgroups[i]);
+				}
+				else {
+					cgroups[i].changed = 1;
+				}
+				break;
+			}
+		}
+	}
+}
+
+static int read_populated (struct cgroup_watch *c) {
+	const char *p;
+
+	if (read_file(c->events_fd) < 0)
+		return -1;
+	p = strstr(cgroup_buf, "populated ");
+	c->populated = p ? p[10] == '1' : 1;
+	return 0;
+}
+
+static int read_cpu (struct cgroup_watch *c, unsigned long long *usec) {
+	const char *p;
+
+	if (read_file(c->cpu_fd) < 0)
+		return -1;
+	p = strstr(cgroup_buf, "usage_usec ");
+	if (!p)
+		return -1;
+	*usec = strtoull(p + 11, NULL, 10);
+	return 0;
+}
+
+/* Bytes read and written on all devices. */
+static int read_io (struct cgroup_watch *c, unsigned long long *bytes) {
+	const char *p;
+
+	*bytes = 0;
+	if (c->io_fd < 0)
+		return 0;
+	if (read_file(c->io_fd) < 0)
+		return -1;
+	for (p = cgroup_buf; (p = strstr(p, "bytes=")); p += 6) {
+		/* rbytes and wbytes, not dbytes (discards) */
+		if (p > cgroup_buf && (p[-1] == 'r' || p[-1] == 'w'))
+			*bytes += strtoull(p + 6, NULL, 10);
+	}
+	return 0;
+}
+
+static int check_cgroup (struct cgroup_watch *c, unsigned char baseline) {
+	unsigned long long cpu, io;
+	unsigned char was_populated;
+	int activity = 0;
+
+	if (c->cpu_fd < 0 && open_cgroup(c) != 0)
+		return 0;
+	was_populated = c->populated;
+	if (c->changed) {
+		c->changed = 0;
+		if (read_populated(c) != 0) {
+			close_cgroup(c);
+			return 0;
+		}
+	}
+	/* An empty cgroup does not use anything, once what it used before it
+	 * got empty is counted. */
+	if (!c->populated && !was_populated)
+		return 0;
+	if (read_cpu(c, &cpu) != 0 || read_io(c, &io) != 0) {
+		/* removed */
+		close_cgroup(c);
+		return 0;
+	}
+	if (c->have_prev && !baseline) {
+		if (c->min_cpu >= 0 && cpu - c->cpu > (unsigned long long)c->min_cpu) {
+			if (debug)
+				printf("sleepd: activity: cgroup %s cpu %llums\n", c->path, (cpu - c->cpu) / 1000);
+			activity = 1;
+		}
+		else if (c->min_io >= 0 && c->io_fd >= 0 && io - c->io > (unsigned long long)c->min_io) {
+			if (debug)
+				printf("sleepd: activity: cgroup %s io %llu bytes\n", c->path, io - c->io);
+			activity = 1;
+		}
+	}
+	c->cpu = cpu;
+	c->io = io;
+	c->have_prev = 1;
+	return activity;
+}
+
+static int cgroup_init (struct activity_source *src) {
+	if (ncgroups == 0)
+		return 0;
+	if (find_mountpoint() != 0) {
+		syslog(LOG_ERR, "no cgroup2 mount");
+		return -1;
+	}
+	cgroup_buf = malloc(CGROUP_BUFSIZE);
+	if (!cgroup_buf)
+		return -1;
+	inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (inotify_fd < 0)
+		syslog(LOG_WARNING, "inotify: %s; cgroup.events is not watched", strerror(errno));
+	return 1;
+}
+
+static int cgroup_sample (struct activity_source *src, long long now, int baseline) {
+	int activity = 0;
+	int i;
+
+	check_inotify();
+	for (i = 0; i < ncgroups; i++) {
+		/* all of them, for the baselines */
+		if (check_cgroup(&cgroups[i], baseline) > 0)
+			activity = 1;
+	}
+	return activity;
+}
+
+static void cgroup_teardown (struct activity_source *src) {
+	int i;
+
+	for (i = 0; i < ncgroups; i++)
+		close_cgroup(&cgroups[i]);
+	if (inotify_fd >= 0)
+		close(inotify_fd);
+	inotify_fd = -1;
+	free(cgroup_buf);
+	cgroup_buf = NULL;
+	free(mountpoint);
+	mountpoint = NULL;
+}
+
+/* A few small preads per populated cgroup. */
+static double cgroup_cost (struct activity_source *src) {
+	return 10000.0 * ncgroups;
+}
+
+struct activity_source cgroup_source = {
+	.name = "cgroup",
+	.flags = ACT_POLLED | ACT_IDLE | ACT_BASELINE,
+	.init = cgroup_init,
+	.sample = cgroup_sample,
+	.cost = cgroup_cost,
+	.teardown = cgroup_teardown,
+};
@@ -0,0 +1,8 @@
+/*
+ * cgroup v2 workload activity source for sleepd
+ * (not Threadsafe!)
+ */
+
+extern struct activity_source cgroup_source;
+
+extern int cgroup_add (const char *spec);
@@ -0,0 +1,345 @@
+/*
+ * Block device I/O activity source for sleepd
+ *
+ * Sectors read and written per second of the configured devices, from
+ * /proc/diskstats. The file is kept open and read with pread; the lines of
+ * the watched devices are indexed, so only those get parsed. A partition is
+ * not counted if its disk is watched, nor a dm or md device if one of the
+ * devices below it is, so the same I/O does not count twice. Block device
+ * uevents trigger building the index again.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sched.h"
+#include "activity.h"
+#include "uevent.h"
+#include "disks.h"
+
+#define DISKSTATS "/proc/diskstats"
+#define SYS_BLOCK "/sys/class/block"
+#define MAX_DISK_RULES 16
+#define MAX_DISKS 64
+#define DISK_BUFSIZE 4096
+#define DISK_NAMELEN 32
+
+/* a --disk argument */
+struct disk_rule
+{
+	char *pattern;
+	unsigned char negate;
+	long long min_rate;	/* sectors per second */
+};
+
+struct disk
+{
+	int line;		/* in /proc/diskstats */
+	char name[DISK_NAMELEN];
+	const struct disk_rule *rule;
+	unsigned long long sectors;
+	unsigned char have_prev;
+};
+
+static struct disk_rule rules[MAX_DISK_RULES];
+static int nrules = 0;
+static struct disk disks[MAX_DISKS];
+static int ndisks = -1;		/* -1 if the index has to be built */
+static int disk_fd = -1;
+static char *disk_buf = NULL;
+static size_t disk_bufsize = 0;
+static long long last_sample = 0;
+
+
+/* "[!]pattern[,sectors=n]", the rate defaults to 128 sectors (of 512
+ * bytes) per second. Returns -1 on a bad spec. */
+int disk_add (const char *spec) {
+	struct disk_rule *r;
+	size_t len = strcspn(spec, ",");
+
+	if (nrules >= MAX_DISK_RULES)
+		return -1;
+	r = &rules[nrules];
+	r->negate = 0;
+	r->min_rate = 128;
+	if (*spec == '!') {
+		r->negate = 1;
+		spec++;
+		len--;
+	}
+	if (len == 0)
+		return -1;
+	if (spec[len] == ',') {
+		char *end;
+		if (strncmp(spec + len + 1, "sectors=", 8) != 0)
+			return -1;
+		r->min_rate = strtoll(spec + len + 9, &end, 10);
+		if (*end != '\0' || r->min_rate < 0)
+			return -1;
+	}
+	r->pattern = strndup(spec, len);
+	if (!r->pattern)
+		return -1;
+	nrules++;
+	return 0;
+}
+
+/* The first rule matching the device, NULL if there is none or it is
+ * excluded. */
+static const struct disk_rule *rule_for (const char *name) {
+	int i;
+
+	for (i = 0; i < nrules; i++) {
+		if (fnmatch(rules[i].pattern, name, 0) == 0)
+			return rules[i].negate ? NULL : &rules[i];
+	}
+	return NULL;
+}
+
+/* The disk a partition is on. Returns -1 for anything else. */
+static int partition_parent (const char *name, char *parent, size_t size) {
+	char path[PATH_MAX], real[PATH_MAX];
+	char *slash;
+
+	snprintf(path, sizeof(path), SYS_BLOCK "/%s/partition", name);
+	if (access(path, F_OK) != 0)
+		return -1;
+	snprintf(path, sizeof(path), SYS_BLOCK "/%s", name);
+	/* .../block/sda/sda1 */
+	if (!realpath(path, real) || !(slash = strrchr(real, '/')))
+		return -1;
+	*slash = '\0';
+	if (!(slash = strrchr(real, '/')))
+		return -1;
+	snprintf(parent, size, "%s", slash + 1);
+	return 0;
+}
+
+/* Whether I/O of the device is counted on a watched device below it: the
+ * disk of a partition or, for dm and md, the devices they are built on. */
+static int lower_watched (const char *name, int depth) {
+	char path[PATH_MAX], parent[DISK_NAMELEN];
+	struct dirent *d;
+	DIR *dir;
+	int found = 0;
+
+	if (depth > 8)
+		return 0;
+	if (partition_parent(name, parent, sizeof(parent)) == 0)
+		return rule_for(parent) || lower_watched(parent, depth + 1);
+	snprintf(path, sizeof(path), SYS_BLOCK "/%s/slaves", name);
+	dir = opendir(path);
+	if (!dir)
+		return 0;
+	while (!found && (d = readdir(dir))) {
+		if (d->d_name[0] == '.')
+			continue;
+		found = rule_for(d->d_name) || lower_watched(d->d_name, depth + 1);
+	}
+	closedir(dir);
+	return found;
+}
+
+/* Read all of /proc/diskstats into disk_buf, which grows as needed and is
+ * reused. Returns the length, or -1 on error. */
+static ssize_t read_all (void) {
+	size_t len = 0;
+	ssize_t n;
+
+	for (;;) {
+		if (len + 1 >= disk_bufsize) {
+			size_t size = disk_bufsize ? disk_bufsize * 2 : DISK_BUFSIZE;
+			char *tmp = realloc(disk_buf, size);
+			if (!tmp)
+				return -1;
+			disk_buf = tmp;
+			disk_bufsize = size;
+		}
+		n = pread(disk_fd, disk_buf + len, disk_bufsize - len - 1, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+		if (n == 0)
+			break;
+		len += n;
+	}
+	disk_buf[len] = '\0';
+	return len;
+}
+
+/* Moves p past "major minor name" and copies the name. Returns -1 if the
+ * line is garbled. */
+static int line_name (const char **p, char *name) {
+	const char *s = *p;
+	size_t len;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		s += strspn(s, " ");
+		s += strspn(s, "0123456789");
+	}
+	s += strspn(s, " ");
+	len = strcspn(s, " \n");
+	if (len == 0 || len >= DISK_NAMELEN)
+		return -1;
+	memcpy(name, s, len);
+	name[len] = '\0';
+	*p = s + len;
+	return 0;
+}
+
+/* Sectors read (3rd field after the name) and written (7th). */
+static unsigned long long line_sectors (const char *p) {
+	unsigned long long v[7];
+	char *end;
+	int i;
+
+	for (i = 0; i < 7; i++) {
+		v[i] = strtoull(p, &end, 10);
+		p = end;
+	}
+	return v[2] + v[6];
+}
+
+/* Find the lines of the devices to watch. Matching the names is only done
+ * here. */
+static void build_index (void) {
+	const char *p = disk_buf;
+	int line;
+
+	ndisks = 0;
+	for (line = 0; p && *p; line++) {
+		const char *q = p;
+		char name[DISK_NAMELEN];
+		const struct disk_rule *r;
+
+		if (line_name(&q, name) == 0 && (r = rule_for(name)) &&
+		    !lower_watched(name, 0) && ndisks < MAX_DISKS) {
+			struct disk *d = &disks[ndisks++];
+			d->line = line;
+			d->rule = r;
+			d->have_prev = 0;
+			strcpy(d->name, name);
+		}
+		p = strchr(p, '\n');
+		if (p)
+			p++;
+	}
+	if (debug) {
+		int i;
+		printf("sleepd: disk: watching");
+		for (i = 0; i < ndisks; i++)
+			printf(" %s", disks[i].name);
+		printf("\n");
+	}
+}
+
+/* Compare the counters of the indexed lines. Returns -1 if the lines moved
+ * (a device was added or removed), the index has to be built again then. */
+static int scan_lines (long long interval, unsigned char baseline) {
+	const char *p = disk_buf;
+	int activity = 0;
+	int line = 0;
+	int i;
+
+	for (i = 0; i < ndisks; i++) {
+		struct disk *d = &disks[i];
+		char name[DISK_NAMELEN];
+		unsigned long long sectors;
+		const char *q;
+
+		while (line < d->line) {
+			p = strchr(p, '\n');
+			if (!p)
+				return -1;
+			p++;
+			line++;
+		}
+		q = p;
+		if (line_name(&q, name) != 0 || strcmp(name, d->name) != 0)
+			return -1;
+		sectors = line_sectors(q);
+		if (d->have_prev && !baseline && interval > 0 && sectors > d->sectors &&
+		    (long long)(sectors - d->sectors) * 1000 / interval > d->rule->min_rate) {
+			if (debug)
+				printf("sleepd: activity: disk %s %lld sectors/s\n", d->name,
+					(long long)(sectors - d->sectors) * 1000 / interval);
+			activity = 1;
+		}
+		d->sectors = sectors;
+		d->have_prev = 1;
+	}
+	return activity;
+}
+
+static void disk_uevent (const char *action, const char *subsystem,
+		const char *msg, size_t len, void *arg) {
+	if (strcmp(subsystem, "block") == 0 &&
+	    (strcmp(action, "add") == 0 || strcmp(action, "remove") == 0))
+		ndisks = -1;
+}
+
+static int disk_init (struct activity_source *src) {
+	if (nrules == 0)
+		return 0;
+	disk_fd = open(DISKSTATS, O_RDONLY | O_CLOEXEC);
+	if (disk_fd < 0) {
+		perror(DISKSTATS);
+		return -1;
+	}
+	ndisks = -1;
+	if (uevent_listen(disk_uevent, NULL) != 0 && debug)
+		printf("sleepd: disk: no hotplug notifications\n");
+	return 1;
+}
+
+static int disk_sample (struct activity_source *src, long long now, int baseline) {
+	long long interval = now - last_sample;
+	int activity;
+
+	last_sample = now;
+	if (read_all() < 0) {
+		perror(DISKSTATS);
+		return 0;
+	}
+	if (ndisks < 0)
+		build_index();
+	activity = scan_lines(interval, baseline);
+	if (activity < 0) {
+		build_index();
+		activity = scan_lines(interval, baseline);
+	}
+	return activity > 0;
+}
+
+static void disk_teardown (struct activity_source *src) {
+	uevent_unlisten(disk_uevent, NULL);
+	if (disk_fd >= 0)
+		close(disk_fd);
+	disk_fd = -1;
+	free(disk_buf);
+	disk_buf = NULL;
+	disk_bufsize = 0;
+}
+
+/* The kernel formats the lines of all block devices on each read. */
+static double disk_cost (struct activity_source *src) {
+	return 20000;
+}
+
+struct activity_source disk_source = {
+	.name = "disk",
+	.flags = ACT_POLLED | ACT_IDLE | ACT_BASELINE,
+	.init = disk_init,
+	.sample = disk_sample,
+	.cost = disk_cost,
+	.teardown = disk_teardown,
+};
@@ -0,0 +1,8 @@
+/*
+ * Block device I/O activity source for sleepd
+ * (not Threadsafe!)
+ */
+
+extern struct activity_source disk_source;
+
+extern int disk_add (const char *spec);
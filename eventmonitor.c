@@ -1,5 +1,5 @@
 // Description:
-// polls /dev/input/event* for any update.
+// watches /dev/input/event* for any update.
 //
 // Modified by Jeff Strunk
 // Originally EventMonitor.c from keywatcher
@@ -16,10 +16,12 @@
 //
 #include <stdlib.h>
 #include <stdio.h>
-#include <pthread.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
+#include <errno.h>
+#include <sys/epoll.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
@@ -27,87 +29,124 @@
 #include <linux/input.h>
 
 #include "eventmonitor.h"
+#include "reactor.h"
+#include "sched.h"
+#include "activity.h"
 
-pthread_mutex_t activity_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t condition_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t condition_cond = PTHREAD_COND_INITIALIZER;
+struct event_data eventData;
 
-void initializeIE(void) {
+// Drain all pending input events of a device. Any event counts as
+// activity; the device gets dropped if it went away.
+static void eventCallback(int fd, unsigned int events, void *arg) {
+	int i = (int)(intptr_t)arg;
+	struct input_event ev[16];
+	ssize_t len;
+
+	while ((len = read(fd, ev, sizeof(ev))) > 0) {
+		eventData.emactivity[i] = 1;
+		eventData.last_activity = sched_now();
+	}
+
+	if (len == 0 || (len < 0 && errno != EAGAIN && errno != EINTR) ||
+	    (events & (EPOLLERR | EPOLLHUP)) != 0) {
+		reactor_del(fd);
+		close(fd);
+		eventData.channels[i] = -1;
+	}
+}
+
+static int openChannel(int i) {
+	int tmpfd = open(eventData.events[i], O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (tmpfd == -1)
+		return -1;
+	if (reactor_add(tmpfd, EPOLLIN, eventCallback, (void *)(intptr_t)i) != 0) {
+		close(tmpfd);
+		return -1;
+	}
+	eventData.channels[i] = tmpfd;
+	return 0;
+}
+
+int eventmonitor_init(void) {
 	int j=0;
 	int i;
-	int tmpfd;
 	if (strncmp(eventData.events[0], "", 1) == 0) {
 		int result;
-		for (i=0; i<MAX_CHANNELS; i++) {
+		for (i=0; i<MAX_CHANNELS-1; i++) {
 			char devName[128];
 			snprintf(devName, 127, "/dev/input/event%d",i);
-				result = access(devName, R_OK);
-				if (result == 0) {
-					strncpy(eventData.events[j], devName, 127);
-					j++;
-				}
-			}
-			strncpy(eventData.events[j], "", 1);
-		}
-
-		i=0;
-		j=0;
-		while (strncmp(eventData.events[i], "", 1) != 0) {
-			tmpfd = open(eventData.events[i], O_RDONLY);
-			if (tmpfd != -1) {
-				eventData.channels[j] = tmpfd;
+			result = access(devName, R_OK);
+			if (result == 0) {
+				strncpy(eventData.events[j], devName, 127);
 				j++;
 			}
-			i++;
 		}
-		eventData.channels[j] = -1;
+		strncpy(eventData.events[j], "", 1);
+	}
+
+	j=0;
+	for (i=0; i<MAX_CHANNELS && strncmp(eventData.events[i], "", 1) != 0; i++) {
+		eventData.channels[i] = -1;
+		eventData.emactivity[i] = 0;
+		if (openChannel(i) == 0)
+			j++;
+	}
+	return j;
 }
 
-void cleanupIE(void)  {
+// Retry devices which were unplugged (or never showed up).
+void eventmonitor_reopen(void) {
 	int i;
-	for (i=0; eventData.channels[i] != -1; i++) {
-		close (eventData.channels[i]);
+	for (i=0; i<MAX_CHANNELS && strncmp(eventData.events[i], "", 1) != 0; i++) {
+		if (eventData.channels[i] == -1)
+			openChannel(i);
 	}
 }
 
-void *eventMonitor() {
-	int i, maxfd=0, retval;
-	fd_set eventWatch;
-
-	while (1) {
-		initializeIE();
-		FD_ZERO(&eventWatch);
-		for (i=0; eventData.channels[i] != -1; i++) {
-			FD_SET (eventData.channels[i], &eventWatch);
-			if (eventData.channels[i] > maxfd)
-				maxfd = eventData.channels[i];
+void eventmonitor_close(void)  {
+	int i;
+	for (i=0; i<MAX_CHANNELS && strncmp(eventData.events[i], "", 1) != 0; i++) {
+		if (eventData.channels[i] != -1) {
+			reactor_del(eventData.channels[i]);
+			close(eventData.channels[i]);
+			eventData.channels[i] = -1;
 		}
+	}
+}
 
-		maxfd++;
-
-		pthread_mutex_lock(&condition_mutex);
-		pthread_cond_wait(&condition_cond, &condition_mutex);
-		pthread_mutex_unlock(&condition_mutex);
+// The devices are watched on the reactor on their own. Their activity is
+// picked up when the idle time gets evaluated.
+static int event_init(struct activity_source *src) {
+	if (!eventData.enabled)
+		return 0;
+	if (eventmonitor_init() == 0 && debug)
+		printf("sleepd: no event devices opened\n");
+	return 1;
+}
 
-		pthread_mutex_lock(&activity_mutex);
-		int i;
-		for (i=0; eventData.channels[i] != -1; i++) {
+static int event_sample(struct activity_source *src, long long now, int baseline) {
+	int i;
+	for (i=0; i<MAX_CHANNELS && strncmp(eventData.events[i], "", 1) != 0; i++) {
+		if (eventData.emactivity[i] == 1) {
+			if (debug)
+				printf("sleepd: activity: keyboard/mouse events %s\n", eventData.events[i]);
 			eventData.emactivity[i] = 0;
 		}
-		pthread_mutex_unlock(&activity_mutex);
-
-		retval = select(maxfd, &eventWatch, NULL, NULL, NULL);
-
-		if (retval > 0 ) {
-			pthread_mutex_lock(&activity_mutex);
-			int i;
-			for (i=0; eventData.channels[i] != -1; i++)
-				if (FD_ISSET(eventData.channels[i], &eventWatch) != 0)
-					eventData.emactivity[i] = 1;
-			pthread_mutex_unlock(&activity_mutex);
-		}
-		cleanupIE();
 	}
+	eventmonitor_reopen();
+	if (eventData.last_activity > src->last_active)
+		src->last_active = eventData.last_activity;
+	return 0;
+}
 
-	pthread_exit(NULL);
+static void event_teardown(struct activity_source *src) {
+	eventmonitor_close();
 }
+
+struct activity_source event_source = {
+	.name = "events",
+	.flags = ACT_DEFERRED,
+	.init = event_init,
+	.sample = event_sample,
+	.teardown = event_teardown,
+};
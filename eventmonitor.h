@@ -4,12 +4,13 @@ struct event_data
 	char events[MAX_CHANNELS][128];
 	int channels[MAX_CHANNELS];
 	int emactivity[MAX_CHANNELS];
+	unsigned char enabled;
+	long long last_activity;	/* CLOCK_MONOTONIC in ms, 0 if none yet */
 };
 
-struct event_data eventData;
+extern struct event_data eventData;
+extern struct activity_source event_source;
 
-extern void *eventMonitor();
-
-extern pthread_mutex_t activity_mutex;
-extern pthread_mutex_t condition_mutex;
-extern pthread_cond_t condition_cond;
+extern int eventmonitor_init (void);
+extern void eventmonitor_reopen (void);
+extern void eventmonitor_close (void);
@@ -177,4 +177,38 @@ int ipc_set_master_pid (pid_t p) {
 	id->master_pid = p;
 	return 0;
 }
+#else
+/* After a crash, the pid in the shm may belong to another process by now,
+ * which SIGUSR1 would terminate. */
+static int is_master (pid_t pid) {
+	char path[32], comm[16];
+	ssize_t len;
+	int fd;
+
+	snprintf(path, sizeof(path), "/proc/%d/comm", (int)pid);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+	len = read(fd, comm, sizeof(comm) - 1);
+	close(fd);
+	if (len <= 0)
+		return 0;
+	comm[len] = '\0';
+	comm[strcspn(comm, "\n")] = '\0';
+	return strcmp(comm, PKG_NAME) == 0;
+}
+
+int ipc_notify_master (void) {
+	struct ipc_data *id = NULL;
+
+	if (ipc_getshmptr(&id) != 0)
+		return -1;
+	if (id->master_pid <= 1 || GET_FLAG(id, FLG_RUNNING) == 0 ||
+	    !is_master(id->master_pid)) {
+		errno = ESRCH;
+		return -1;
+	}
+
+	return kill(id->master_pid, IPC_NOTIFY_SIG);
+}
 #endif
@@ -26,6 +26,9 @@
 #endif
 #define IPC_XDISPMAX 32
 
+/* sent by sleepctl to wake up the master after changing the shm segment */
+#define IPC_NOTIFY_SIG SIGUSR1
+
 struct ipc_data
 {
 	pthread_mutex_t shm_mtx;
@@ -58,4 +61,6 @@ extern int ipc_getshmptr (struct ipc_data **id);
 extern int ipc_master_running (void);
 #ifdef IS_MASTER
 extern int ipc_set_master_pid (pid_t p);
+#else
+extern int ipc_notify_master (void);
 #endif
@@ -0,0 +1,148 @@
+/*
+ * Benchmark of the /proc/interrupts parser of sleepd
+ *
+ * Builds a synthetic /proc/interrupts of a 512 CPU machine, formatted like
+ * the kernel does (one 11 character column per CPU, named rows like NMI and
+ * LOC, ERR and MIS with a single column), and times the parser of irqs.c
+ * on it: the scan of the watched rows alone, and the scan including the
+ * read of the file. The sums are checked against the generated counters.
+ *
+ * make bench; ./irqbench [cpus [rounds]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "irqs.c"
+
+#define BENCH_CPUS 512
+#define BENCH_ROUNDS 10000
+#define BENCH_IRQS 128
+
+unsigned char debug = 0;
+
+/* Hotplug is of no interest here. */
+int uevent_listen (uevent_cb cb, void *arg) {
+	return -1;
+}
+
+void uevent_unlisten (uevent_cb cb, void *arg) {
+}
+
+static const char *const named[] = {
+	"NMI", "LOC", "SPU", "PMI", "IWI", "RTR", "RES", "CAL", "TLB",
+	"TRM", "THR", "DFR", "MCE", "MCP", "HYP", "HRE", "HVS", "PIN",
+	"NPI", "PIW",
+};
+
+static double elapsed (const struct timespec *a, const struct timespec *b) {
+	return (b->tv_sec - a->tv_sec) * 1e9 + (b->tv_nsec - a->tv_nsec);
+}
+
+/* Writes the fixture to f. Every 16th irq is an i8042 one for autoprobing,
+ * their sums go to expect. */
+static void fixture (FILE *f, int cpus, unsigned long long *expect) {
+	int irq, cpu;
+	size_t i;
+
+	fprintf(f, "%*s", 11, "");
+	for (cpu = 0; cpu < cpus; cpu++)
+		fprintf(f, "CPU%-8d", cpu);
+	fputc('\n', f);
+	for (irq = 0; irq < BENCH_IRQS; irq++) {
+		unsigned long long sum = 0;
+
+		fprintf(f, "%4d: ", irq);
+		for (cpu = 0; cpu < cpus; cpu++) {
+			/* mostly idle, some CPUs busy */
+			unsigned int v = ((irq + cpu) % 7 == 0) ? (unsigned int)(irq * 100003 + cpu * 17) : 0;
+			fprintf(f, "%10u ", v);
+			sum += v;
+		}
+		if (irq % 16 == 1)
+			fprintf(f, " IO-APIC   %d-edge      i8042\n", irq);
+		else
+			fprintf(f, " PCI-MSI %d-edge      nvme0q%d\n", irq << 10, irq);
+		expect[irq] = sum;
+	}
+	for (i = 0; i < sizeof(named) / sizeof(named[0]); i++) {
+		fprintf(f, "%s: ", named[i]);
+		for (cpu = 0; cpu < cpus; cpu++)
+			fprintf(f, "%10u ", (unsigned int)(cpu * 31 + i));
+		fprintf(f, "  Some interrupts\n");
+	}
+	fprintf(f, "ERR:          0\n");
+	fprintf(f, "MIS:          0\n");
+	fflush(f);
+}
+
+int main (int argc, char **argv) {
+	static unsigned long long expect[BENCH_IRQS];
+	int cpus = (argc > 1) ? atoi(argv[1]) : BENCH_CPUS;
+	int rounds = (argc > 2) ? atoi(argv[2]) : BENCH_ROUNDS;
+	struct timespec a, b;
+	ssize_t len;
+	FILE *f;
+	int r, i, bad = 0;
+
+	if (cpus <= 0 || rounds <= 0) {
+		fprintf(stderr, "usage: %s [cpus [rounds]]\n", argv[0]);
+		return 1;
+	}
+	f = tmpfile();
+	if (!f) {
+		perror("tmpfile");
+		return 1;
+	}
+	fixture(f, cpus, expect);
+	irq_fd = fileno(f);
+	len = read_all(irq_fd);
+	if (len <= 0) {
+		perror("read");
+		return 1;
+	}
+	build_index();
+	read_all(irq_fd);
+	need_resolve = 0;
+	printf("irqbench: %d cpus, %zd bytes, watching %d of %d irqs\n",
+		ncpus, len, nrows, BENCH_IRQS);
+
+	/* the sums of the watched rows */
+	for (r = 0; r < nrows; r++) {
+		const char *p = irq_buf, *q;
+
+		for (i = 0; i < rows[r].line; i++)
+			p = strchr(p, '\n') + 1;
+		q = p;
+		row_irq(&q);
+		if (row_sum(q) != expect[rows[r].irq]) {
+			fprintf(stderr, "irqbench: irq %d: %llu != %llu\n",
+				rows[r].irq, row_sum(q), expect[rows[r].irq]);
+			bad = 1;
+		}
+	}
+
+	scan_rows(1);
+	clock_gettime(CLOCK_MONOTONIC, &a);
+	for (r = 0; r < rounds; r++) {
+		if (scan_rows(1) != 0)
+			bad = 1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &b);
+	printf("irqbench: scan: %.0f ns per round\n", elapsed(&a, &b) / rounds);
+
+	clock_gettime(CLOCK_MONOTONIC, &a);
+	for (r = 0; r < rounds; r++) {
+		if (check_irqs(1) != 0)
+			bad = 1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &b);
+	printf("irqbench: read and scan: %.0f ns per round, %.0f MB/s\n",
+		elapsed(&a, &b) / rounds, len * rounds / (elapsed(&a, &b) / 1e3));
+
+	irq_fd = -1;	/* closed by fclose */
+	irq_teardown(&irq_source);
+	fclose(f);
+	return bad;
+}
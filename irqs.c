@@ -0,0 +1,553 @@
+/*
+ * /proc/interrupts activity source for sleepd
+ *
+ * Watches the interrupt counters of the given irqs, of the irqs whose
+ * action or chip name matches a pattern, or of the keyboard and mouse irqs
+ * found by autoprobing. Their counters are summed over all CPUs, an irq may
+ * be steered to any of them.
+ *
+ * The irqs are resolved through /sys/kernel/irq/<n>/{actions,chip_name},
+ * then only their per_cpu_count files are read. Hotplug uevents trigger
+ * a new lookup. Without /sys/kernel/irq, /proc/interrupts stays open and
+ * is read into one buffer; only the rows of those irqs get parsed.
+ */
+
+#define _GNU_SOURCE	/* FNM_CASEFOLD */
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "sched.h"
+#include "activity.h"
+#include "irqs.h"
+#include "sleepd.h"
+#include "uevent.h"
+
+#define IRQ_BUFSIZE 16384
+#define IRQ_PAD 8		/* room after the end of the data for skip_spaces */
+#define IRQ_SYSFS "/sys/kernel/irq"
+#define MAX_IRQ_NAMES 16
+#define MAX_IRQ_WATCH 64
+
+/* a row of /proc/interrupts to examine */
+struct irq_row
+{
+	int line;
+	int irq;
+};
+
+/* an irq resolved through sysfs */
+struct irq_watch
+{
+	int irq;
+	int fd;			/* per_cpu_count */
+	unsigned long long count;
+};
+
+static unsigned char irqs[MAX_IRQS];	/* irqs to examine have a value of 1 */
+static const char *irq_names[MAX_IRQ_NAMES];	/* action/chip name patterns */
+static int nnames = 0;
+static unsigned char autoprobe = 1;
+static unsigned char have_irqs = 0;
+static unsigned char use_sysfs = 0;
+static unsigned char need_resolve = 1;
+static struct irq_watch watched[MAX_IRQ_WATCH];
+static int nwatched = 0;
+static int irq_fd = -1;			/* /proc/interrupts */
+static char *irq_buf = NULL;		/* all of /proc/interrupts */
+static size_t irq_bufsize = 0;
+static struct irq_row rows[MAX_IRQS];
+static int nrows = -1;			/* -1 until the index is built */
+static int ncpus = 0;			/* number of counter columns */
+
+
+/* Returns -1 if irq is out of range. */
+int irq_watch (int irq) {
+	if ((irq < 0) || (irq >= MAX_IRQS))
+		return -1;
+	irqs[irq] = 1;
+	autoprobe = 0;
+	have_irqs = 1;
+	return 0;
+}
+
+void irq_set_autoprobe (unsigned char on) {
+	autoprobe = on;
+}
+
+/* Watch irqs by action or chip name, pattern is a shell glob. Returns -1
+ * if there are too many patterns. */
+int irq_watch_name (const char *pattern) {
+	if (nnames >= MAX_IRQ_NAMES)
+		return -1;
+	irq_names[nnames++] = pattern;
+	autoprobe = 0;
+	have_irqs = 1;
+	return 0;
+}
+
+int irq_configured (void) {
+	return autoprobe || have_irqs;
+}
+
+/* Read all of fd into irq_buf, which grows as needed and is reused.
+ * Returns the length, or -1 on error. */
+static ssize_t read_all (int fd) {
+	size_t len = 0;
+	ssize_t n;
+
+	for (;;) {
+		if (len + IRQ_PAD >= irq_bufsize) {
+			size_t size = irq_bufsize ? irq_bufsize * 2 : IRQ_BUFSIZE;
+			char *tmp = realloc(irq_buf, size);
+			if (!tmp)
+				return -1;
+			irq_buf = tmp;
+			irq_bufsize = size;
+		}
+		n = pread(fd, irq_buf + len, irq_bufsize - len - IRQ_PAD, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+		if (n == 0)
+			break;
+		len += n;
+	}
+	memset(irq_buf + len, '\0', IRQ_PAD);
+	return len;
+}
+
+/* Number of a numbered row ("  12:  3456 ..."), -1 for the header and named
+ * rows (NMI, LOC, ...). p is moved past the ':'. */
+static int row_irq (const char **p) {
+	const char *s = *p;
+	int irq = 0;
+
+	while (*s == ' ')
+		s++;
+	if (!isdigit((unsigned char)*s))
+		return -1;
+	while (isdigit((unsigned char)*s))
+		irq = irq * 10 + (*s++ - '0');
+	if (*s != ':')
+		return -1;
+	*p = s + 1;
+	return irq;
+}
+
+/* Skip the padding between columns. On many-core machines a row is mostly
+ * spaces, so it is skipped 8 bytes at a time. */
+static const char *skip_spaces (const char *p) {
+	static const uint64_t spaces = 0x2020202020202020ULL;
+	uint64_t w;
+
+	for (;;) {
+		memcpy(&w, p, sizeof(w));
+		if (w != spaces)
+			break;
+		p += sizeof(w);
+	}
+	while (*p == ' ')
+		p++;
+	return p;
+}
+
+/* Sum of the per-CPU columns of a row. Rows with fewer columns (ERR, MIS)
+ * end at the first field that is not a number. */
+static unsigned long long row_sum (const char *p) {
+	unsigned long long sum = 0;
+	int cpu;
+
+	for (cpu = 0; cpu < ncpus; cpu++) {
+		unsigned long long v = 0;
+
+		p = skip_spaces(p);
+		if (!isdigit((unsigned char)*p))
+			break;
+		do {
+			v = v * 10 + (*p++ - '0');
+		} while (isdigit((unsigned char)*p));
+		sum += v;
+	}
+	return sum;
+}
+
+/* The header names one column per (possible) CPU. */
+static int count_cpus (const char *p) {
+	int n = 0;
+
+	while ((p = strstr(p, "CPU")) != NULL) {
+		n++;
+		p += 3;
+	}
+	return n;
+}
+
+/* Does name match one of the patterns, or (with probe set) look like a
+ * keyboard or mouse? Returns 2 for a probed match. */
+static int name_matches (const char *name, unsigned char probe) {
+	static const char *const probes[] = {
+		"*mouse*", "*keyboard*",
+		/* 2.5 kernels report by chipset,
+		 * this is a ps/2 keyboard/mouse. */
+		"*i8042*",
+		"*i2c?hid*",
+	};
+	size_t i;
+
+	for (i = 0; i < (size_t)nnames; i++) {
+		if (fnmatch(irq_names[i], name, FNM_CASEFOLD) == 0)
+			return 1;
+	}
+	for (i = 0; probe && i < sizeof(probes) / sizeof(probes[0]); i++) {
+		if (fnmatch(probes[i], name, FNM_CASEFOLD) == 0)
+			return 2;
+	}
+	return 0;
+}
+
+/* Match each of the names in list (separated by any of sep). */
+static int list_matches (char *list, const char *sep, unsigned char probe) {
+	char *save = NULL, *name;
+	int m, match = 0;
+
+	for (name = strtok_r(list, sep, &save); name; name = strtok_r(NULL, sep, &save)) {
+		while (*name == ' ')
+			name++;
+		if ((m = name_matches(name, probe)) > match)
+			match = m;
+	}
+	return match;
+}
+
+/* Find the rows of the irqs to examine. Matching the device names is only
+ * done here. The row is modified, it has to be read again afterwards. */
+static void build_index (void) {
+	static int no_dev_warned = 0;
+	char *p = irq_buf;
+	int line, probed = 0;
+
+	nrows = 0;
+	if (p && *p) {
+		char *end = strchr(p, '\n');
+		if (end)
+			*end = '\0';
+		ncpus = count_cpus(p);
+		if (end)
+			*end = '\n';
+	}
+	for (line = 0; p && *p; line++) {
+		char *end = strchr(p, '\n');
+		const char *q = p;
+		int irq = row_irq(&q);
+		int do_this_one = 0;
+
+		if (end)
+			*end = '\0';
+		if (irq >= 0 && (autoprobe || nnames > 0)) {
+			/* The chip and action names follow the counters. */
+			do_this_one = list_matches((char *)q, " \t,", autoprobe);
+			if (do_this_one == 2)
+				probed = 1;
+		}
+		if (irq >= 0 && irq < MAX_IRQS && (do_this_one || irqs[irq]) &&
+		    nrows < MAX_IRQS) {
+			rows[nrows].line = line;
+			rows[nrows].irq = irq;
+			nrows++;
+		}
+		if (end)
+			*end = '\n';
+		p = end ? end + 1 : NULL;
+	}
+
+	if (autoprobe && ! probed) {
+		if (! no_dev_warned) {
+			no_dev_warned = 1;
+			syslog(LOG_WARNING, "no keyboard or mouse irqs autoprobed");
+		}
+	}
+	if (debug)
+		printf("sleepd: irq: watching %d of %d rows\n", nrows, line);
+}
+
+/* Read a small sysfs attribute of an irq into buf. */
+static int read_attr (int irq, const char *attr, char *buf, size_t size) {
+	char path[64];
+	ssize_t n;
+	int fd;
+
+	snprintf(path, sizeof(path), IRQ_SYSFS "/%d/%s", irq, attr);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	n = read(fd, buf, size - 1);
+	close(fd);
+	if (n < 0)
+		return -1;
+	buf[n] = '\0';
+	return 0;
+}
+
+/* Look up the irqs to examine in /sys/kernel/irq and open their counters.
+ * Counters of irqs that stay are carried over. */
+static void resolve_sysfs (void) {
+	static int no_dev_warned = 0;
+	struct irq_watch old[MAX_IRQ_WATCH];
+	int nold = nwatched;
+	int i, probed = 0;
+	struct dirent *d;
+	DIR *dir;
+
+	dir = opendir(IRQ_SYSFS);
+	if (!dir) {
+		perror(IRQ_SYSFS);
+		return;
+	}
+	memcpy(old, watched, sizeof(old));
+	nwatched = 0;
+	need_resolve = 0;
+
+	while ((d = readdir(dir)) != NULL) {
+		char buf[512], path[64];
+		int irq, match = 0;
+		char *end;
+
+		if (!isdigit((unsigned char)d->d_name[0]))
+			continue;
+		irq = (int)strtol(d->d_name, &end, 10);
+		if (*end != '\0')
+			continue;
+		if (irq < MAX_IRQS && irqs[irq])
+			match = 1;
+		if (!match && (autoprobe || nnames > 0)) {
+			if (read_attr(irq, "actions", buf, sizeof(buf)) == 0)
+				match = list_matches(buf, ",\n", autoprobe);
+			if (!match && nnames > 0 && read_attr(irq, "chip_name", buf, sizeof(buf)) == 0)
+				match = list_matches(buf, "\n", 0);
+		}
+		if (!match)
+			continue;
+		if (match == 2)
+			probed = 1;
+		if (nwatched >= MAX_IRQ_WATCH) {
+			syslog(LOG_WARNING, "only %d irqs can be watched", MAX_IRQ_WATCH);
+			break;
+		}
+
+		watched[nwatched].irq = irq;
+		watched[nwatched].fd = -1;
+		watched[nwatched].count = 0;
+		for (i = 0; i < nold; i++) {
+			if (old[i].irq == irq && old[i].fd >= 0) {
+				watched[nwatched] = old[i];
+				old[i].fd = -1;
+				break;
+			}
+		}
+		if (watched[nwatched].fd < 0) {
+			snprintf(path, sizeof(path), IRQ_SYSFS "/%d/per_cpu_count", irq);
+			watched[nwatched].fd = open(path, O_RDONLY | O_CLOEXEC);
+			if (watched[nwatched].fd < 0)
+				continue;
+		}
+		if (debug)
+			printf("sleepd: irq: watching %d\n", irq);
+		nwatched++;
+	}
+	closedir(dir);
+	for (i = 0; i < nold; i++) {
+		if (old[i].fd >= 0)
+			close(old[i].fd);
+	}
+
+	if (autoprobe && ! probed) {
+		if (! no_dev_warned) {
+			no_dev_warned = 1;
+			syslog(LOG_WARNING, "no keyboard or mouse irqs autoprobed");
+		}
+	}
+}
+
+/* Sum of a comma separated per_cpu_count. */
+static unsigned long long list_sum (const char *p) {
+	unsigned long long sum = 0;
+
+	for (;;) {
+		unsigned long long v = 0;
+
+		if (!isdigit((unsigned char)*p))
+			break;
+		do {
+			v = v * 10 + (*p++ - '0');
+		} while (isdigit((unsigned char)*p));
+		sum += v;
+		if (*p != ',')
+			break;
+		p++;
+	}
+	return sum;
+}
+
+static int scan_sysfs (unsigned char baseline) {
+	int activity = 0;
+	int i;
+
+	for (i = 0; i < nwatched; i++) {
+		unsigned long long v;
+
+		if (read_all(watched[i].fd) <= 0) {
+			/* the irq went away */
+			need_resolve = 1;
+			continue;
+		}
+		v = list_sum(irq_buf);
+		if (watched[i].count != v) {
+			if (debug && ! baseline)
+				printf("sleepd: activity: irq %d\n", watched[i].irq);
+			activity = 1;
+			watched[i].count = v;
+		}
+	}
+	return activity;
+}
+
+/* Compare the counters of the indexed rows. Returns -1 if the rows moved
+ * (an irq was added or removed), the index has to be rebuilt then. */
+static int scan_rows (unsigned char baseline) {
+	static unsigned long long irq_count[MAX_IRQS]; /* holds previous counters of the irqs */
+
+	const char *p = irq_buf;
+	int activity = 0;
+	int line = 0;
+	int r;
+
+	for (r = 0; r < nrows; r++) {
+		const char *q;
+		unsigned long long v;
+		int irq;
+
+		while (line < rows[r].line) {
+			p = strchr(p, '\n');
+			if (!p)
+				return -1;
+			p++;
+			line++;
+		}
+		q = p;
+		irq = row_irq(&q);
+		if (irq != rows[r].irq)
+			return -1;
+		v = row_sum(q);
+		if (irq_count[irq] != v) {
+			if (debug && ! baseline)
+				printf("sleepd: activity: irq %d\n", irq);
+			activity = 1;
+			irq_count[irq] = v;
+		}
+	}
+	return activity;
+}
+
+/* With baseline set only the counters are refreshed (activity is already
+ * known for this round). */
+static unsigned char check_irqs (unsigned char baseline) {
+	int activity;
+
+	if (use_sysfs) {
+		/* Keep probing until a keyboard or mouse shows up. */
+		if (need_resolve || (autoprobe && nwatched == 0))
+			resolve_sysfs();
+		return scan_sysfs(baseline) > 0;
+	}
+
+	if (read_all(irq_fd) < 0) {
+		perror(INTERRUPTS);
+		return 0;
+	}
+	/* Keep probing until a keyboard or mouse shows up. */
+	if (nrows < 0 || need_resolve || (autoprobe && nrows == 0)) {
+		need_resolve = 0;
+		build_index();
+		read_all(irq_fd);
+	}
+	activity = scan_rows(baseline);
+	if (activity < 0) {
+		build_index();
+		read_all(irq_fd);
+		activity = scan_rows(baseline);
+	}
+	return activity > 0;
+}
+
+/* Devices come and go, and with them their irqs or irq actions. */
+static void irq_uevent (const char *action, const char *subsystem,
+		const char *msg, size_t len, void *arg) {
+	if (strcmp(action, "add") == 0 || strcmp(action, "remove") == 0 ||
+	    strcmp(action, "bind") == 0 || strcmp(action, "unbind") == 0)
+		need_resolve = 1;
+}
+
+static int irq_init (struct activity_source *src) {
+	if (!irq_configured())
+		return 0;
+	if (access(IRQ_SYSFS, R_OK | X_OK) == 0) {
+		use_sysfs = 1;
+	}
+	else {
+		irq_fd = open(INTERRUPTS, O_RDONLY | O_CLOEXEC);
+		if (irq_fd < 0) {
+			perror(INTERRUPTS);
+			return -1;
+		}
+	}
+	nrows = -1;
+	need_resolve = 1;
+	if (uevent_listen(irq_uevent, NULL) != 0 && debug)
+		printf("sleepd: irq: no hotplug notifications\n");
+	return 1;
+}
+
+static int irq_sample (struct activity_source *src, long long now, int baseline) {
+	return check_irqs(baseline);
+}
+
+static void irq_teardown (struct activity_source *src) {
+	int i;
+
+	uevent_unlisten(irq_uevent, NULL);
+	for (i = 0; i < nwatched; i++)
+		close(watched[i].fd);
+	nwatched = 0;
+	if (irq_fd >= 0)
+		close(irq_fd);
+	irq_fd = -1;
+	free(irq_buf);
+	irq_buf = NULL;
+	irq_bufsize = 0;
+}
+
+/* The kernel formats all of /proc/interrupts on each read, the sysfs
+ * counters are one small read per irq. */
+static double irq_cost (struct activity_source *src) {
+	return use_sysfs ? 5000 : 40000;
+}
+
+struct activity_source irq_source = {
+	.name = "irq",
+	.flags = ACT_POLLED | ACT_IDLE | ACT_BASELINE,
+	.init = irq_init,
+	.sample = irq_sample,
+	.cost = irq_cost,
+	.teardown = irq_teardown,
+};
@@ -0,0 +1,11 @@
+/*
+ * /proc/interrupts activity source for sleepd
+ * (not Threadsafe!)
+ */
+
+extern struct activity_source irq_source;
+
+extern int irq_watch (int irq);
+extern int irq_watch_name (const char *pattern);
+extern void irq_set_autoprobe (unsigned char on);
+extern int irq_configured (void);
@@ -0,0 +1,184 @@
+/*
+ * Load activity sources for sleepd
+ *
+ * With PSI (/proc/pressure), the kernel is asked to report when tasks were
+ * stalled on cpu, io or memory for some time within a window; every report
+ * counts as activity, nothing is polled. Otherwise a load average at or
+ * above the given maximum counts as activity. If the triggers fail without
+ * a maximum, it is the number of CPUs: at that load, tasks wait for a CPU.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#include "reactor.h"
+#include "sched.h"
+#include "activity.h"
+#include "loadavg.h"
+
+/* a PSI trigger, times in ms */
+struct psi_trigger
+{
+	const char *resource;
+	int stall;		/* 0 if not configured */
+	int window;
+	int fd;
+};
+
+static double max_loadavg = 0;
+static struct psi_trigger triggers[] = {
+	{ "cpu", 0, 0, -1 },
+	{ "io", 0, 0, -1 },
+	{ "memory", 0, 0, -1 },
+};
+#define NTRIGGERS (int)(sizeof(triggers) / sizeof(triggers[0]))
+static long long psi_last = 0;
+
+
+void load_set_max (double loadavg) {
+	max_loadavg = loadavg;
+}
+
+/* "resource[=stall:window]", stall and window in ms. Returns -1 if the
+ * resource or the times are bad. */
+int psi_add_trigger (const char *spec) {
+	size_t len = strcspn(spec, "=");
+	int stall = 150, window = 1000;
+	int i;
+
+	if (spec[len] == '=') {
+		char *end;
+		stall = (int)strtol(spec + len + 1, &end, 10);
+		if (*end != ':')
+			return -1;
+		window = (int)strtol(end + 1, &end, 10);
+		if (*end != '\0')
+			return -1;
+	}
+	/* the kernel takes windows from 500ms to 10s */
+	if (window < 500 || window > 10000 || stall <= 0 || stall > window)
+		return -1;
+	for (i = 0; i < NTRIGGERS; i++) {
+		if (strlen(triggers[i].resource) == len &&
+		    strncmp(triggers[i].resource, spec, len) == 0) {
+			triggers[i].stall = stall;
+			triggers[i].window = window;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static void psi_cb (int fd, unsigned int events, void *arg) {
+	struct psi_trigger *t = arg;
+
+	if (events & EPOLLERR) {
+		syslog(LOG_WARNING, "%s pressure trigger failed", t->resource);
+		reactor_del(fd);
+		close(fd);
+		t->fd = -1;
+		return;
+	}
+	psi_last = sched_now();
+	if (debug)
+		printf("sleepd: activity: %s pressure\n", t->resource);
+}
+
+static void psi_teardown (struct activity_source *src) {
+	int i;
+
+	for (i = 0; i < NTRIGGERS; i++) {
+		if (triggers[i].fd < 0)
+			continue;
+		reactor_del(triggers[i].fd);
+		close(triggers[i].fd);
+		triggers[i].fd = -1;
+	}
+}
+
+static int psi_init (struct activity_source *src) {
+	int i, n = 0;
+
+	for (i = 0; i < NTRIGGERS; i++) {
+		struct psi_trigger *t = &triggers[i];
+		char path[32], trig[64];
+		int len;
+
+		if (t->stall == 0)
+			continue;
+		snprintf(path, sizeof(path), "/proc/pressure/%s", t->resource);
+		len = snprintf(trig, sizeof(trig), "some %d %d", t->stall * 1000, t->window * 1000);
+		t->fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+		if (t->fd < 0 || write(t->fd, trig, len + 1) < 0 ||
+		    reactor_add(t->fd, EPOLLPRI, psi_cb, t) != 0) {
+			int err = errno;
+			if (t->fd >= 0)
+				close(t->fd);
+			t->fd = -1;
+			psi_teardown(src);
+			if (max_loadavg == 0) {
+				long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+				max_loadavg = ncpus > 0 ? ncpus : 1;
+			}
+			/* after daemon(), stderr is gone */
+			syslog(LOG_WARNING, "%s: %s; no pressure triggers, using a load average of %g",
+				path, strerror(err), max_loadavg);
+			return -1;
+		}
+		n++;
+	}
+	return n > 0;
+}
+
+/* The triggers are on the reactor, there is nothing to sample. */
+static int psi_sample (struct activity_source *src, long long now, int baseline) {
+	if (psi_last > src->last_active)
+		src->last_active = psi_last;
+	return 0;
+}
+
+/* The load average is the fallback when the pressure triggers are not
+ * available, psi_source is initialized first. */
+static int load_init (struct activity_source *src) {
+	return max_loadavg != 0 && !psi_source.enabled;
+}
+
+static int load_sample (struct activity_source *src, long long now, int baseline) {
+	double loadavg[1];
+
+	if ((getloadavg(loadavg, 1) == 1) &&
+	    (loadavg[0] >= max_loadavg)) {
+		/* If the load average is too high */
+		if (debug)
+			printf("sleepd: activity: load average %f\n", loadavg[0]);
+		return 1;
+	}
+	return 0;
+}
+
+/* One small read of /proc/loadavg. */
+static double load_cost (struct activity_source *src) {
+	return 3000;
+}
+
+struct activity_source psi_source = {
+	.name = "psi",
+	.flags = ACT_DEFERRED | ACT_IDLE,
+	.init = psi_init,
+	.sample = psi_sample,
+	.teardown = psi_teardown,
+};
+
+struct activity_source load_source = {
+	.name = "load",
+	.flags = ACT_POLLED | ACT_IDLE,
+	.init = load_init,
+	.sample = load_sample,
+	.cost = load_cost,
+};
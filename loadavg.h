@@ -0,0 +1,10 @@
+/*
+ * Load activity sources for sleepd
+ * (not Threadsafe!)
+ */
+
+extern struct activity_source psi_source;
+extern struct activity_source load_source;
+
+extern void load_set_max (double loadavg);
+extern int psi_add_trigger (const char *spec);
@@ -0,0 +1,504 @@
+/*
+ * Network traffic activity source for sleepd
+ *
+ * Compares the packet and byte rates of the selected interfaces with minimum
+ * rates. A rate is either that of the last sample, the average over the last
+ * n samples (a ring of counter deltas with a running sum), or a moving
+ * average with a half-life. Each costs the same per sample, whatever n or
+ * the half-life is. Interfaces are selected by
+ * name patterns. The counters of all of them come from one RTM_GETLINK dump
+ * (IFLA_STATS64) per sample; link notifications keep the set of interfaces
+ * up to date in between.
+ */
+
+#include <errno.h>
+#include <fnmatch.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <linux/if.h>
+#include <linux/if_link.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#include "sched.h"
+#include "activity.h"
+#include "netdev.h"
+#include "reactor.h"
+#include "sleepd.h"
+
+#define NET_BUFSIZE 32768
+
+/* the counters, in struct net_rule and struct net_if */
+#define NET_TX       0
+#define NET_RX       1
+#define NET_TX_BYTES 2
+#define NET_RX_BYTES 3
+#define NET_COUNTERS 4
+
+/* what was set for a rule, besides the minimum rates */
+#define NET_SET_SAMPLES  0x10
+#define NET_SET_HALFLIFE 0x20
+
+/* an -N pattern with its thresholds */
+struct net_rule
+{
+	const char *pattern;
+	unsigned char negate;	/* "!pattern" excludes interfaces */
+	unsigned char set;	/* 1 << counter and NET_SET_* */
+	long long min[NET_COUNTERS];	/* minimum rates per second, -1 if unused */
+	unsigned char samples;	/* net samples for rx/tx */
+	double halflife;	/* in ms, 0 if not averaged */
+};
+
+/* an interface the kernel told us about */
+struct net_if
+{
+	int ifindex;
+	char name[IFNAMSIZ];
+	const struct net_rule *rule;	/* NULL if not selected */
+	unsigned char seen;		/* in the current dump */
+	unsigned char have_count;
+	uint64_t count[NET_COUNTERS];	/* previous counters */
+	/* -m: the deltas of the last samples and their sum */
+	uint64_t (*ring)[NET_COUNTERS];
+	long long *ring_ms;
+	uint64_t sum[NET_COUNTERS];
+	long long sum_ms;
+	unsigned char ring_idx;
+	unsigned char ring_len;
+	/* half-life: moving averages of the rates */
+	double avg[NET_COUNTERS];
+	unsigned char have_avg;
+};
+
+static const char *const counter_names[NET_COUNTERS] = {
+	"txrate", "rxrate", "txbytes", "rxbytes"
+};
+
+static struct net_rule *rules = NULL;
+static int nrules = 0;
+static struct net_if *ifs = NULL;
+static int nifs = 0;
+static int dump_fd = -1;		/* RTM_GETLINK requests */
+static int monitor_fd = -1;		/* RTNLGRP_LINK notifications */
+static unsigned int dump_seq = 0;
+static char *net_buf = NULL;
+
+
+/* Add an interface pattern, "!pattern" excludes. NULL selects all
+ * interfaces. Returns the index of the rule, or -1. */
+int net_add_device (const char *dev) {
+	struct net_rule *tmp = realloc(rules, (nrules + 1) * sizeof(*rules));
+	struct net_rule *r;
+
+	if (!tmp)
+		return -1;
+	rules = tmp;
+	r = &rules[nrules];
+	memset(r, '\0', sizeof(*r));
+	if (dev && dev[0] == '!') {
+		r->negate = 1;
+		dev++;
+	}
+	r->pattern = strdup(dev ? dev : "*");
+	if (!r->pattern)
+		return -1;
+	r->min[NET_TX] = TXRATE;
+	r->min[NET_RX] = RXRATE;
+	r->min[NET_TX_BYTES] = -1;
+	r->min[NET_RX_BYTES] = -1;
+	r->samples = 1;
+	return nrules++;
+}
+
+/* The setters return -1 if the value was already set for this rule. */
+static int set_min (int idx, int counter, long long rate) {
+	if (rules[idx].set & (1 << counter))
+		return -1;
+	rules[idx].min[counter] = rate;
+	rules[idx].set |= 1 << counter;
+	return 0;
+}
+
+int net_set_min_tx (int idx, int rate) {
+	return set_min(idx, NET_TX, rate);
+}
+
+int net_set_min_rx (int idx, int rate) {
+	return set_min(idx, NET_RX, rate);
+}
+
+int net_set_min_tx_bytes (int idx, long long rate) {
+	return set_min(idx, NET_TX_BYTES, rate);
+}
+
+int net_set_min_rx_bytes (int idx, long long rate) {
+	return set_min(idx, NET_RX_BYTES, rate);
+}
+
+/* samples has to be between 2 and MAX_SAMPLES. */
+int net_set_samples (int idx, int samples) {
+	if (rules[idx].set & NET_SET_SAMPLES)
+		return -1;
+	rules[idx].samples = samples;
+	rules[idx].set |= NET_SET_SAMPLES;
+	return 0;
+}
+
+/* halflife in seconds, has to be > 0. */
+int net_set_halflife (int idx, double halflife) {
+	if (rules[idx].set & NET_SET_HALFLIFE)
+		return -1;
+	rules[idx].halflife = halflife * 1000;
+	rules[idx].set |= NET_SET_HALFLIFE;
+	return 0;
+}
+
+/* The first rule that matches name, NULL if it is not selected. Without
+ * any positive pattern, everything not excluded is selected. */
+static const struct net_rule *select_if (const char *name) {
+	/* the default rule for "-N !pattern" alone */
+	static const struct net_rule all = { "*", 0, 0, { TXRATE, RXRATE, -1, -1 }, 1, 0 };
+	const struct net_rule *match = NULL;
+	int i, positive = 0;
+
+	for (i = 0; i < nrules; i++) {
+		if (!rules[i].negate)
+			positive = 1;
+		if (fnmatch(rules[i].pattern, name, 0) != 0)
+			continue;
+		if (rules[i].negate)
+			return NULL;
+		if (!match)
+			match = &rules[i];
+	}
+	return positive ? match : &all;
+}
+
+static struct net_if *find_if (int ifindex) {
+	int i;
+
+	for (i = 0; i < nifs; i++) {
+		if (ifs[i].ifindex == ifindex)
+			return &ifs[i];
+	}
+	return NULL;
+}
+
+/* Forget the samples of an interface. */
+static void reset_if (struct net_if *nif) {
+	free(nif->ring);
+	free(nif->ring_ms);
+	nif->ring = NULL;
+	nif->ring_ms = NULL;
+	memset(nif->sum, '\0', sizeof(nif->sum));
+	nif->sum_ms = 0;
+	nif->ring_idx = nif->ring_len = 0;
+	nif->have_count = nif->have_avg = 0;
+}
+
+/* Add or rename an interface. Returns NULL if out of memory. */
+static struct net_if *update_if (int ifindex, const char *name) {
+	struct net_if *nif = find_if(ifindex);
+
+	if (!nif) {
+		struct net_if *tmp = realloc(ifs, (nifs + 1) * sizeof(*ifs));
+		if (!tmp)
+			return NULL;
+		ifs = tmp;
+		nif = &ifs[nifs++];
+		memset(nif, '\0', sizeof(*nif));
+		nif->ifindex = ifindex;
+	}
+	else if (strncmp(nif->name, name, IFNAMSIZ) == 0) {
+		return nif;
+	}
+	strncpy(nif->name, name, IFNAMSIZ - 1);
+	reset_if(nif);
+	nif->rule = select_if(nif->name);
+	if (nif->rule && nif->rule->samples > 1) {
+		nif->ring = calloc(nif->rule->samples, sizeof(*nif->ring));
+		nif->ring_ms = calloc(nif->rule->samples, sizeof(*nif->ring_ms));
+		if (!nif->ring || !nif->ring_ms) {
+			reset_if(nif);
+			nif->rule = NULL;
+		}
+	}
+	if (debug && nif->rule)
+		printf("sleepd: net: watching %s\n", nif->name);
+	return nif;
+}
+
+static void remove_if (struct net_if *nif) {
+	if (debug && nif->rule)
+		printf("sleepd: net: %s is gone\n", nif->name);
+	reset_if(nif);
+	*nif = ifs[--nifs];
+}
+
+/* Difference between two readings of a counter. Some drivers only keep 32
+ * bit counters; a counter that went backwards from near 2^32 wrapped
+ * there, otherwise it was reset. */
+static uint64_t counter_delta (uint64_t prev, uint64_t cur) {
+	if (cur >= prev)
+		return cur - prev;
+	if (prev <= UINT32_MAX && prev > UINT32_MAX / 2)
+		return cur + ((uint64_t)UINT32_MAX + 1) - prev;
+	return 0;
+}
+
+/* Update the rates of an interface with new counters, interval ms after the
+ * previous ones. Constant time: the window sum is moved by one sample and
+ * the moving average by one step. With baseline set the rates are updated
+ * but not compared. */
+static int update_rate (struct net_if *nif, const uint64_t *count,
+		long long interval, unsigned char baseline) {
+	const struct net_rule *r = nif->rule;
+	double rate[NET_COUNTERS];
+	double alpha = 0;
+	int activity = 0;
+	int c;
+
+	if (! nif->have_count || interval <= 0) {
+		memcpy(nif->count, count, sizeof(nif->count));
+		nif->have_count = 1;
+		return 0;
+	}
+
+	if (r->halflife > 0)
+		alpha = 1 - exp2(-interval / r->halflife);
+	if (nif->ring) {
+		/* drop the oldest sample once the ring is full */
+		if (nif->ring_len == r->samples)
+			nif->sum_ms -= nif->ring_ms[nif->ring_idx];
+		else
+			nif->ring_len++;
+		nif->ring_ms[nif->ring_idx] = interval;
+		nif->sum_ms += interval;
+	}
+	for (c = 0; c < NET_COUNTERS; c++) {
+		uint64_t delta = counter_delta(nif->count[c], count[c]);
+
+		rate[c] = (double)delta * 1000 / interval;
+		if (nif->ring) {
+			nif->sum[c] -= nif->ring[nif->ring_idx][c];
+			nif->ring[nif->ring_idx][c] = delta;
+			nif->sum[c] += delta;
+			/* the average over the whole window, not of the rates */
+			rate[c] = (double)nif->sum[c] * 1000 / nif->sum_ms;
+		}
+		if (alpha > 0) {
+			nif->avg[c] = nif->have_avg ? nif->avg[c] + alpha * (rate[c] - nif->avg[c]) : rate[c];
+			rate[c] = nif->avg[c];
+		}
+	}
+	if (nif->ring && ++nif->ring_idx >= r->samples)
+		nif->ring_idx = 0;
+	nif->have_avg = 1;
+	memcpy(nif->count, count, sizeof(nif->count));
+
+	for (c = 0; c < NET_COUNTERS && ! baseline; c++) {
+		if (r->min[c] >= 0 && rate[c] > r->min[c]) {
+			if (debug) {
+				printf("sleepd: activity: network %s %s: %.0f > %lld", nif->name,
+					counter_names[c], rate[c], r->min[c]);
+				if (nif->ring)
+					printf(" (%d samples)", nif->ring_len);
+				if (alpha > 0)
+					printf(" (half-life %.1fs)", r->halflife / 1000);
+				printf("\n");
+			}
+			activity = 1;
+			break;
+		}
+	}
+	return activity;
+}
+
+/* Handle one RTM_NEWLINK or RTM_DELLINK. With stats set, the counters of a
+ * selected interface are compared. */
+static int link_msg (struct nlmsghdr *nh, int stats, long long interval, unsigned char baseline) {
+	struct ifinfomsg *ifi = NLMSG_DATA(nh);
+	struct rtattr *rta;
+	struct rtnl_link_stats64 st;
+	uint64_t count[NET_COUNTERS];
+	const char *name = NULL;
+	int have_stats = 0;
+	struct net_if *nif;
+	int len;
+
+	if (nh->nlmsg_len < NLMSG_LENGTH(sizeof(*ifi)))
+		return 0;
+	if (nh->nlmsg_type == RTM_DELLINK) {
+		if ((nif = find_if(ifi->ifi_index)) != NULL)
+			remove_if(nif);
+		return 0;
+	}
+	if (nh->nlmsg_type != RTM_NEWLINK)
+		return 0;
+
+	len = nh->nlmsg_len - NLMSG_LENGTH(sizeof(*ifi));
+	for (rta = IFLA_RTA(ifi); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		if (rta->rta_type == IFLA_IFNAME)
+			name = RTA_DATA(rta);
+		else if (rta->rta_type == IFLA_STATS64 &&
+		         RTA_PAYLOAD(rta) >= sizeof(st)) {
+			/* attributes are only 4 byte aligned */
+			memcpy(&st, RTA_DATA(rta), sizeof(st));
+			have_stats = 1;
+		}
+	}
+	if (!name || (nif = update_if(ifi->ifi_index, name)) == NULL)
+		return 0;
+	nif->seen = 1;
+	if (!stats || !nif->rule || !have_stats)
+		return 0;
+	count[NET_TX] = st.tx_packets;
+	count[NET_RX] = st.rx_packets;
+	count[NET_TX_BYTES] = st.tx_bytes;
+	count[NET_RX_BYTES] = st.rx_bytes;
+	return update_rate(nif, count, interval, baseline);
+}
+
+/* Link notifications, interfaces that appear, get renamed or go away. */
+static void monitor_callback (int fd, unsigned int events, void *arg) {
+	ssize_t len;
+
+	while ((len = recv(fd, net_buf, NET_BUFSIZE, MSG_DONTWAIT)) > 0) {
+		struct nlmsghdr *nh;
+		for (nh = (struct nlmsghdr *)net_buf; NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len))
+			link_msg(nh, 0, 0, 1);
+	}
+}
+
+/* One dump of all links with their counters. interval is the time since the
+ * previous call in ms. Returns 1 on activity, -1 on error. */
+static int check_net (long long interval, unsigned char baseline) {
+	struct {
+		struct nlmsghdr nh;
+		struct ifinfomsg ifi;
+	} req;
+	int activity = 0, done = 0, intr = 0, i;
+
+	memset(&req, '\0', sizeof(req));
+	req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(req.ifi));
+	req.nh.nlmsg_type = RTM_GETLINK;
+	req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	req.nh.nlmsg_seq = ++dump_seq;
+	req.ifi.ifi_family = AF_UNSPEC;
+	if (send(dump_fd, &req, req.nh.nlmsg_len, 0) < 0)
+		return -1;
+
+	for (i = 0; i < nifs; i++)
+		ifs[i].seen = 0;
+	while (!done) {
+		struct nlmsghdr *nh;
+		ssize_t len = recv(dump_fd, net_buf, NET_BUFSIZE, 0);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len <= 0)
+			return -1;
+		for (nh = (struct nlmsghdr *)net_buf; NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len)) {
+			if (nh->nlmsg_seq != dump_seq)
+				continue;
+			if (nh->nlmsg_type == NLMSG_ERROR) {
+				struct nlmsgerr *err = NLMSG_DATA(nh);
+				/* the table stays as it is */
+				errno = nh->nlmsg_len >= NLMSG_LENGTH(sizeof(*err)) && err->error ? -err->error : EIO;
+				return -1;
+			}
+			if (nh->nlmsg_flags & NLM_F_DUMP_INTR)
+				intr = 1;
+			if (nh->nlmsg_type == NLMSG_DONE) {
+				done = 1;
+				break;
+			}
+			if (link_msg(nh, 1, interval, baseline) > 0)
+				activity = 1;
+		}
+	}
+	/* In case a notification got lost. Only a complete dump tells which
+	 * interfaces are gone. */
+	for (i = 0; i < nifs && !intr; ) {
+		if (!ifs[i].seen)
+			remove_if(&ifs[i]);
+		else
+			i++;
+	}
+	return activity;
+}
+
+static int net_init (struct activity_source *src) {
+	struct sockaddr_nl sa;
+
+	if (nrules == 0)
+		return 0;
+	net_buf = malloc(NET_BUFSIZE);
+	dump_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (!net_buf || dump_fd < 0) {
+		perror("sleepd: rtnetlink");
+		return -1;
+	}
+
+	monitor_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_ROUTE);
+	memset(&sa, '\0', sizeof(sa));
+	sa.nl_family = AF_NETLINK;
+	sa.nl_groups = RTMGRP_LINK;
+	if (monitor_fd < 0 || bind(monitor_fd, (struct sockaddr *)&sa, sizeof(sa)) != 0 ||
+	    reactor_add(monitor_fd, EPOLLIN, monitor_callback, NULL) != 0) {
+		/* the dumps still find new interfaces */
+		if (debug)
+			printf("sleepd: net: no link notifications\n");
+		if (monitor_fd >= 0)
+			close(monitor_fd);
+		monitor_fd = -1;
+	}
+	return 1;
+}
+
+static int net_sample (struct activity_source *src, long long now, int baseline) {
+	struct sched_task *t = &src->task;
+	int activity = check_net(t->last ? now - t->last : t->period, baseline);
+
+	if (activity < 0) {
+		perror("sleepd: RTM_GETLINK");
+		return 0;
+	}
+	return activity;
+}
+
+static void net_teardown (struct activity_source *src) {
+	if (monitor_fd >= 0) {
+		reactor_del(monitor_fd);
+		close(monitor_fd);
+	}
+	if (dump_fd >= 0)
+		close(dump_fd);
+	monitor_fd = dump_fd = -1;
+	free(net_buf);
+	net_buf = NULL;
+	while (nifs > 0)
+		reset_if(&ifs[--nifs]);
+	free(ifs);
+	ifs = NULL;
+}
+
+/* One dump, its size grows with the number of interfaces. */
+static double net_cost (struct activity_source *src) {
+	return 20000;
+}
+
+struct activity_source net_source = {
+	.name = "net",
+	.flags = ACT_POLLED | ACT_IDLE | ACT_BASELINE,
+	.init = net_init,
+	.sample = net_sample,
+	.cost = net_cost,
+	.teardown = net_teardown,
+};
@@ -0,0 +1,14 @@
+/*
+ * Network traffic activity source for sleepd
+ * (not Threadsafe!)
+ */
+
+extern struct activity_source net_source;
+
+extern int net_add_device (const char *dev);
+extern int net_set_min_tx (int idx, int rate);
+extern int net_set_min_rx (int idx, int rate);
+extern int net_set_min_tx_bytes (int idx, long long rate);
+extern int net_set_min_rx_bytes (int idx, long long rate);
+extern int net_set_samples (int idx, int samples);
+extern int net_set_halflife (int idx, double halflife);
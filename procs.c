@@ -0,0 +1,316 @@
+/*
+ * Process watchlist activity source for sleepd
+ *
+ * While a process whose name matches one of the patterns runs, the system
+ * is active. The kernel proc connector reports every exec and exit, so /proc
+ * is only scanned once at startup (and again if events were lost); the pids
+ * of the matching processes are kept in a hash set. A socket filter drops
+ * the other proc connector events (fork, uid changes, ...) in the kernel.
+ */
+
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/cn_proc.h>
+#include <linux/connector.h>
+#include <linux/filter.h>
+#include <linux/netlink.h>
+
+#include "sched.h"
+#include "activity.h"
+#include "procs.h"
+
+#define MAX_PROC_PATTERNS 16
+#define PROC_BUFSIZE 8192
+#define PROC_COMMLEN 16
+
+static char *patterns[MAX_PROC_PATTERNS];
+static int npatterns = 0;
+static int cn_fd = -1;
+/* pids of the matching processes, open addressing, 0 is free */
+static pid_t *pids = NULL;
+static size_t pid_size = 0;
+static size_t npids = 0;
+
+
+/* "name|name|...", the names may be glob patterns. Returns -1 if there are
+ * too many. */
+int proc_add_pattern (const char *spec) {
+	const char *p = spec;
+
+	while (*p) {
+		size_t len = strcspn(p, "|");
+		if (len > 0) {
+			if (npatterns >= MAX_PROC_PATTERNS)
+				return -1;
+			patterns[npatterns] = strndup(p, len);
+			if (!patterns[npatterns])
+				return -1;
+			npatterns++;
+		}
+		p += len;
+		if (*p == '|')
+			p++;
+	}
+	return npatterns > 0 ? 0 : -1;
+}
+
+static size_t pid_slot (pid_t pid) {
+	size_t i = ((size_t)pid * 2654435761u) & (pid_size - 1);
+
+	while (pids[i] != 0 && pids[i] != pid)
+		i = (i + 1) & (pid_size - 1);
+	return i;
+}
+
+/* Kept at most half full. */
+static int pid_add (pid_t pid) {
+	size_t i;
+
+	if ((npids + 1) * 2 > pid_size) {
+		pid_t *old = pids;
+		size_t old_size = pid_size;
+
+		pid_size = pid_size ? pid_size * 2 : 64;
+		pids = calloc(pid_size, sizeof(*pids));
+		if (!pids) {
+			pids = old;
+			pid_size = old_size;
+			return -1;
+		}
+		for (i = 0; i < old_size; i++) {
+			if (old[i])
+				pids[pid_slot(old[i])] = old[i];
+		}
+		free(old);
+	}
+	i = pid_slot(pid);
+	if (pids[i] == 0) {
+		pids[i] = pid;
+		npids++;
+	}
+	return 0;
+}
+
+/* Linear probing: the entries after the removed one are moved up into the
+ * gap if their probe sequence passes through it. */
+static int pid_remove (pid_t pid) {
+	size_t i, j, k;
+
+	if (npids == 0)
+		return 0;
+	i = pid_slot(pid);
+	if (pids[i] == 0)
+		return 0;
+	pids[i] = 0;
+	npids--;
+	for (j = (i + 1) & (pid_size - 1); pids[j] != 0; j = (j + 1) & (pid_size - 1)) {
+		k = ((size_t)pids[j] * 2654435761u) & (pid_size - 1);
+		/* k cyclically in (i, j]: it stays */
+		if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+			continue;
+		pids[i] = pids[j];
+		pids[j] = 0;
+		i = j;
+	}
+	return 1;
+}
+
+/* Reads the name of a process, returns -1 if it is gone. */
+static int read_comm (pid_t pid, char *comm) {
+	char path[32];
+	ssize_t len;
+	int fd;
+
+	snprintf(path, sizeof(path), "/proc/%d/comm", (int)pid);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	len = read(fd, comm, PROC_COMMLEN - 1);
+	close(fd);
+	if (len <= 0)
+		return -1;
+	if (comm[len - 1] == '\n')
+		len--;
+	comm[len] = '\0';
+	return 0;
+}
+
+static int matches (const char *comm) {
+	int i;
+
+	for (i = 0; i < npatterns; i++) {
+		if (fnmatch(patterns[i], comm, 0) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+/* A process started a new program, which may or may not be watched. */
+static void check_exec (pid_t pid) {
+	char comm[PROC_COMMLEN];
+
+	if (read_comm(pid, comm) == 0 && matches(comm)) {
+		if (pid_add(pid) == 0 && debug)
+			printf("sleepd: proc: %s [%d] started\n", comm, (int)pid);
+	}
+	else if (pid_remove(pid) && debug) {
+		printf("sleepd: proc: [%d] no longer watched\n", (int)pid);
+	}
+}
+
+static void scan_proc (void) {
+	struct dirent *d;
+	DIR *dir = opendir("/proc");
+
+	if (!dir) {
+		perror("sleepd: /proc");
+		return;
+	}
+	npids = 0;
+	if (pids)
+		memset(pids, '\0', pid_size * sizeof(*pids));
+	while ((d = readdir(dir))) {
+		if (isdigit((unsigned char)d->d_name[0]))
+			check_exec((pid_t)atoi(d->d_name));
+	}
+	closedir(dir);
+}
+
+/* Keep only exec and exit events, checked in the kernel. */
+static int attach_filter (int fd) {
+	struct sock_filter code[] = {
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, NLMSG_LENGTH(0) + offsetof(struct cn_msg, data) +
+			offsetof(struct proc_event, what)),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, htonl(PROC_EVENT_EXEC), 2, 0),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, htonl(PROC_EVENT_EXIT), 1, 0),
+		BPF_STMT(BPF_RET | BPF_K, 0),
+		BPF_STMT(BPF_RET | BPF_K, 0xffffffff),
+	};
+	struct sock_fprog prog = {
+		.len = sizeof(code) / sizeof(code[0]),
+		.filter = code,
+	};
+
+	return setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog));
+}
+
+static int send_op (enum proc_cn_mcast_op op) {
+	struct {
+		struct nlmsghdr nh;
+		struct cn_msg cn;
+		enum proc_cn_mcast_op op;
+	} __attribute__ ((packed)) req;
+
+	memset(&req, '\0', sizeof(req));
+	req.nh.nlmsg_len = sizeof(req);
+	req.nh.nlmsg_type = NLMSG_DONE;
+	req.nh.nlmsg_pid = getpid();
+	req.cn.id.idx = CN_IDX_PROC;
+	req.cn.id.val = CN_VAL_PROC;
+	req.cn.len = sizeof(req.op);
+	req.op = op;
+	return send(cn_fd, &req, sizeof(req), 0) < 0 ? -1 : 0;
+}
+
+static int proc_init (struct activity_source *src) {
+	struct sockaddr_nl addr;
+
+	if (npatterns == 0)
+		return 0;
+	cn_fd = socket(PF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_CONNECTOR);
+	if (cn_fd < 0) {
+		perror("sleepd: proc connector");
+		return -1;
+	}
+	memset(&addr, '\0', sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = CN_IDX_PROC;
+	addr.nl_pid = getpid();
+	if (attach_filter(cn_fd) != 0 ||
+	    bind(cn_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+	    send_op(PROC_CN_MCAST_LISTEN) != 0) {
+		perror("sleepd: proc connector");
+		close(cn_fd);
+		cn_fd = -1;
+		return -1;
+	}
+	/* after subscribing, so no process is missed */
+	scan_proc();
+	return 1;
+}
+
+static int proc_fd (struct activity_source *src) {
+	return cn_fd;
+}
+
+/* The exec and exit events since the previous sample. A watched process
+ * running is activity, and so is its exit: the idle time starts from
+ * there, not from the sample before. */
+static int proc_sample (struct activity_source *src, long long now, int baseline) {
+	char buf[PROC_BUFSIZE] __attribute__ ((aligned(NLMSG_ALIGNTO)));
+	size_t running = npids;
+	ssize_t len;
+
+	while ((len = recv(cn_fd, buf, sizeof(buf), 0)) != 0) {
+		struct nlmsghdr *nh;
+
+		if (len < 0) {
+			if (errno == ENOBUFS) {
+				/* events were lost */
+				scan_proc();
+				continue;
+			}
+			break;
+		}
+		for (nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len)) {
+			struct cn_msg *cn = NLMSG_DATA(nh);
+			struct proc_event ev;
+
+			if (nh->nlmsg_len < NLMSG_LENGTH(sizeof(*cn) + offsetof(struct proc_event, event_data.exit.exit_code)))
+				continue;
+			/* the event is not 8 byte aligned in the message */
+			memset(&ev, '\0', sizeof(ev));
+			memcpy(&ev, cn->data, cn->len < sizeof(ev) ? cn->len : sizeof(ev));
+			if (ev.what == PROC_EVENT_EXEC) {
+				check_exec(ev.event_data.exec.process_tgid);
+			}
+			else if (ev.what == PROC_EVENT_EXIT &&
+			         ev.event_data.exit.process_pid == ev.event_data.exit.process_tgid) {
+				/* the process, not one of its threads */
+				if (pid_remove(ev.event_data.exit.process_tgid) && debug)
+					printf("sleepd: proc: [%d] exited\n", (int)ev.event_data.exit.process_tgid);
+			}
+		}
+	}
+	return npids > 0 || npids < running;
+}
+
+static void proc_teardown (struct activity_source *src) {
+	if (cn_fd >= 0) {
+		send_op(PROC_CN_MCAST_IGNORE);
+		close(cn_fd);
+	}
+	cn_fd = -1;
+	free(pids);
+	pids = NULL;
+	pid_size = npids = 0;
+}
+
+struct activity_source proc_source = {
+	.name = "proc",
+	.flags = ACT_DEFERRED | ACT_IDLE,
+	.init = proc_init,
+	.fd = proc_fd,
+	.sample = proc_sample,
+	.teardown = proc_teardown,
+};
@@ -0,0 +1,8 @@
+/*
+ * Process watchlist activity source for sleepd
+ * (not Threadsafe!)
+ */
+
+extern struct activity_source proc_source;
+
+extern int proc_add_pattern (const char *spec);
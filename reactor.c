@@ -0,0 +1,154 @@
+/*
+ * An epoll/timerfd based event loop for sleepd
+ *
+ * Every fd backed activity source registers a callback here. The periodic
+ * checks are driven by a timerfd armed on absolute CLOCK_MONOTONIC deadlines
+ * (see sched.c), so they do not drift by however long the checks take.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "reactor.h"
+
+#define REACTOR_MAXEVENTS 16
+
+struct reactor_handler
+{
+	int fd;
+	reactor_cb cb;
+	void *arg;
+};
+
+static int epfd = -1;
+static int tickfd = -1;
+static struct reactor_handler handlers[REACTOR_MAXFDS];
+
+
+int reactor_init (void) {
+	struct epoll_event ev;
+	int i;
+
+	for (i = 0; i < REACTOR_MAXFDS; i++)
+		handlers[i].fd = -1;
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0)
+		return -1;
+	tickfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (tickfd < 0) {
+		reactor_close();
+		return -1;
+	}
+
+	/* The tick is the only registration without a handler. */
+	memset(&ev, '\0', sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, tickfd, &ev) != 0) {
+		reactor_close();
+		return -1;
+	}
+	return 0;
+}
+
+void reactor_close (void) {
+	if (tickfd >= 0)
+		close(tickfd);
+	if (epfd >= 0)
+		close(epfd);
+	tickfd = epfd = -1;
+}
+
+int reactor_add (int fd, unsigned int events, reactor_cb cb, void *arg) {
+	struct epoll_event ev;
+	int i;
+
+	if (epfd < 0 || fd < 0 || !cb)
+		return -1;
+	for (i = 0; i < REACTOR_MAXFDS; i++) {
+		if (handlers[i].fd == -1)
+			break;
+	}
+	if (i == REACTOR_MAXFDS) {
+		errno = ENOSPC;
+		return -1;
+	}
+
+	memset(&ev, '\0', sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = &handlers[i];
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) != 0)
+		return -1;
+	handlers[i].fd = fd;
+	handlers[i].cb = cb;
+	handlers[i].arg = arg;
+	return 0;
+}
+
+/* Must be called before the fd gets closed. */
+int reactor_del (int fd) {
+	int i;
+
+	for (i = 0; i < REACTOR_MAXFDS; i++) {
+		if (handlers[i].fd == fd) {
+			handlers[i].fd = -1;
+			return epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+		}
+	}
+	errno = ENOENT;
+	return -1;
+}
+
+/* Arm the timer on an absolute CLOCK_MONOTONIC deadline (in ms). A negative
+ * deadline disarms it. */
+int reactor_set_deadline (long long ms) {
+	struct itimerspec its;
+
+	if (tickfd < 0)
+		return -1;
+	memset(&its, '\0', sizeof(its));
+	if (ms >= 0) {
+		/* 0 would disarm the timer, the deadline has passed anyway */
+		if (ms == 0)
+			ms = 1;
+		its.it_value.tv_sec = ms / 1000;
+		its.it_value.tv_nsec = (ms % 1000) * 1000000;
+	}
+	return timerfd_settime(tickfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/* Wait for and dispatch one batch of events. Returns the number of timer
+ * expirations (0 if only fds fired), or -1 on error. */
+int reactor_wait (void) {
+	struct epoll_event ev[REACTOR_MAXEVENTS];
+	uint64_t ticks = 0;
+	int i, n;
+
+	if (epfd < 0)
+		return -1;
+	do {
+		n = epoll_wait(epfd, ev, REACTOR_MAXEVENTS, -1);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0)
+		return -1;
+	for (i = 0; i < n; i++) {
+		struct reactor_handler *h = ev[i].data.ptr;
+		if (h == NULL) {
+			uint64_t exp;
+			if (read(tickfd, &exp, sizeof(exp)) == sizeof(exp))
+				ticks += exp;
+		}
+		else if (h->fd >= 0) {
+			/* fd is -1 if an earlier callback in this
+			 * batch unregistered it. */
+			h->cb(h->fd, ev[i].events, h->arg);
+		}
+	}
+	return (int)ticks;
+}
@@ -0,0 +1,15 @@
+/*
+ * An epoll/timerfd based event loop for sleepd
+ * (not Threadsafe!)
+ */
+
+#define REACTOR_MAXFDS 128
+
+typedef void (*reactor_cb)(int fd, unsigned int events, void *arg);
+
+extern int reactor_init (void);
+extern void reactor_close (void);
+extern int reactor_add (int fd, unsigned int events, reactor_cb cb, void *arg);
+extern int reactor_del (int fd);
+extern int reactor_set_deadline (long long ms);
+extern int reactor_wait (void);
@@ -0,0 +1,101 @@
+/*
+ * Suspend/resume detection for sleepd
+ *
+ * CLOCK_MONOTONIC stops while the system is suspended, CLOCK_BOOTTIME does
+ * not. The growth of the gap between them is exactly the time spent in
+ * suspend, no matter what happens to the wall clock (NTP steps, date -s).
+ *
+ * To notice a resume right away, a CLOCK_REALTIME timerfd with
+ * TFD_TIMER_CANCEL_ON_SET is armed far in the future. The kernel cancels it
+ * on every discontinuous change of the realtime clock, which includes the
+ * resume from suspend. The gap then tells apart a resume from a clock step.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "resume.h"
+#include "reactor.h"
+
+#ifndef TFD_TIMER_CANCEL_ON_SET
+#define TFD_TIMER_CANCEL_ON_SET (1 << 1)
+#endif
+
+static int cancelfd = -1;
+static resume_hook hook = NULL;
+static long long last_gap = 0;
+
+
+static long long clock_ms (clockid_t clk) {
+	struct timespec ts;
+
+	clock_gettime(clk, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static long long boot_gap (void) {
+	return clock_ms(CLOCK_BOOTTIME) - clock_ms(CLOCK_MONOTONIC);
+}
+
+static int arm_cancelfd (void) {
+	struct itimerspec its;
+
+	memset(&its, '\0', sizeof(its));
+	/* Never expires, we only want the cancellation. */
+	its.it_value.tv_sec = (time_t)((~(uint64_t)0) >> 1);
+	return timerfd_settime(cancelfd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &its, NULL);
+}
+
+static void cancel_cb (int fd, unsigned int events, void *arg) {
+	uint64_t exp;
+
+	/* ECANCELED: the realtime clock jumped, re-arm and see why. */
+	if (read(fd, &exp, sizeof(exp)) < 0 && errno != ECANCELED && errno != EAGAIN)
+		return;
+	arm_cancelfd();
+	resume_check();
+}
+
+/* Returns the time spent in suspend since the last call (in ms), 0 if none.
+ * Calls the hook when it was not 0. */
+long long resume_check (void) {
+	long long gap = boot_gap();
+	long long slept = gap - last_gap;
+
+	if (slept < RESUME_MIN_MS)
+		return 0;
+	last_gap = gap;
+	if (hook)
+		hook(slept);
+	return slept;
+}
+
+/* Without the timerfd (old kernels) resume_check still works when polled. */
+int resume_init (resume_hook h) {
+	hook = h;
+	last_gap = boot_gap();
+
+	cancelfd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (cancelfd < 0)
+		return -1;
+	if (arm_cancelfd() != 0 ||
+	    reactor_add(cancelfd, EPOLLIN, cancel_cb, NULL) != 0) {
+		close(cancelfd);
+		cancelfd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+void resume_close (void) {
+	if (cancelfd >= 0) {
+		reactor_del(cancelfd);
+		close(cancelfd);
+	}
+	cancelfd = -1;
+}
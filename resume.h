@@ -0,0 +1,13 @@
+/*
+ * Suspend/resume detection for sleepd
+ * (not Threadsafe!)
+ */
+
+/* Gaps shorter than this are clock noise, not a suspend (in ms). */
+#define RESUME_MIN_MS 200
+
+typedef void (*resume_hook)(long long slept_ms);
+
+extern int resume_init (resume_hook hook);
+extern long long resume_check (void);
+extern void resume_close (void);
@@ -0,0 +1,220 @@
+/*
+ * A per-source sampling scheduler for sleepd
+ *
+ * Every activity source has its own period and jitter budget. The due times
+ * are kept in a binary min-heap, the reactor timer is armed on the earliest
+ * one. When it fires, every task within its jitter budget runs as well, so
+ * sources with similar periods share a wakeup.
+ *
+ * Activity checks sharing a wakeup run cheapest expected cost per hit first.
+ * Once one of them saw activity, the others have nothing to add to this
+ * round and only refresh their baseline (if they have state) or are skipped.
+ */
+
+#include <stddef.h>
+#include <time.h>
+
+#include "sched.h"
+#include "reactor.h"
+
+static struct sched_task *heap[SCHED_MAXTASKS];
+static int heap_len = 0;
+static unsigned int next_order = 0;
+static long long max_jitter = 0;
+
+/* weight of a new sample in the cost and hit rate averages */
+#define SCHED_EWMA 0.125
+/* keeps checks which never hit from being ordered by cost alone */
+#define SCHED_MIN_HIT_RATE 0.01
+
+
+long long sched_now (void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int heap_less (const struct sched_task *a, const struct sched_task *b) {
+	if (a->due != b->due)
+		return a->due < b->due;
+	return a->order < b->order;
+}
+
+static long long now_ns (void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Expected cost until a check confirms activity. */
+static double score (const struct sched_task *t) {
+	double rate = t->hit_rate;
+
+	if (rate < SCHED_MIN_HIT_RATE)
+		rate = SCHED_MIN_HIT_RATE;
+	return t->cost / rate;
+}
+
+/* Order of a batch: activity checks by score, then the rest by order. */
+static int run_before (const struct sched_task *a, const struct sched_task *b) {
+	int ca = (a->flags & SCHED_ACTIVITY) != 0;
+	int cb = (b->flags & SCHED_ACTIVITY) != 0;
+
+	if (ca != cb)
+		return ca;
+	if (ca && score(a) != score(b))
+		return score(a) < score(b);
+	return a->order < b->order;
+}
+
+static void heap_set (int i, struct sched_task *t) {
+	heap[i] = t;
+	t->idx = i;
+}
+
+static void heap_up (int i) {
+	struct sched_task *t = heap[i];
+
+	while (i > 0 && heap_less(t, heap[(i - 1) / 2])) {
+		heap_set(i, heap[(i - 1) / 2]);
+		i = (i - 1) / 2;
+	}
+	heap_set(i, t);
+}
+
+static void heap_down (int i) {
+	struct sched_task *t = heap[i];
+
+	for (;;) {
+		int c = 2 * i + 1;
+		if (c >= heap_len)
+			break;
+		if (c + 1 < heap_len && heap_less(heap[c + 1], heap[c]))
+			c++;
+		if (!heap_less(heap[c], t))
+			break;
+		heap_set(i, heap[c]);
+		i = c;
+	}
+	heap_set(i, t);
+}
+
+static int heap_push (struct sched_task *t) {
+	if (heap_len >= SCHED_MAXTASKS)
+		return -1;
+	heap[heap_len] = t;
+	heap_up(heap_len++);
+	return 0;
+}
+
+static struct sched_task *heap_pop (void) {
+	struct sched_task *t;
+
+	if (heap_len == 0)
+		return NULL;
+	t = heap[0];
+	t->idx = -1;
+	if (--heap_len > 0) {
+		heap[0] = heap[heap_len];
+		heap_down(0);
+	}
+	return t;
+}
+
+/* Schedule a task for the first time. */
+int sched_add (struct sched_task *task, long long due) {
+	if (!task || !task->run || task->period <= 0)
+		return -1;
+	task->due = due;
+	task->last = 0;
+	task->order = next_order++;
+	if (task->jitter < 0)
+		task->jitter = 0;
+	if (task->jitter > max_jitter)
+		max_jitter = task->jitter;
+	return heap_push(task);
+}
+
+/* Move a task to another due time, SCHED_NEVER parks it. May be called from
+ * a task's run function to override its next period. */
+void sched_set_due (struct sched_task *task, long long due) {
+	task->due = due;
+	if (task->idx < 0)
+		return;
+	heap_up(task->idx);
+	heap_down(task->idx);
+}
+
+/* Wait for the earliest task to become due, then run it and every other
+ * task whose jitter budget allows running now. Returns the number of tasks
+ * run, or -1 on error. */
+int sched_run (void) {
+	struct sched_task *run[SCHED_MAXTASKS], *later[SCHED_MAXTASKS];
+	int nrun = 0, nlater = 0;
+	int activity = 0;
+	long long now;
+	int i, j;
+
+	if (heap_len == 0)
+		return -1;
+	/* fd callbacks may reschedule tasks, so re-arm after each batch */
+	while (heap[0]->due > (now = sched_now())) {
+		long long due = heap[0]->due;
+		if (reactor_set_deadline(due == SCHED_NEVER ? -1 : due) != 0 ||
+		    reactor_wait() < 0)
+			return -1;
+	}
+
+	/* Everything due before now + max_jitter is a candidate. */
+	while (heap_len > 0 && heap[0]->due <= now + max_jitter) {
+		struct sched_task *t = heap_pop();
+		if (t->due - t->jitter <= now)
+			run[nrun++] = t;
+		else
+			later[nlater++] = t;
+	}
+	for (i = 0; i < nlater; i++)
+		heap_push(later[i]);
+
+	for (i = 1; i < nrun; i++) {
+		struct sched_task *t = run[i];
+		for (j = i; j > 0 && run_before(t, run[j - 1]); j--)
+			run[j] = run[j - 1];
+		run[j] = t;
+	}
+
+	for (i = 0; i < nrun; i++) {
+		struct sched_task *t = run[i];
+		/* Stay on the period grid, skip the slots we missed. */
+		t->due += t->period;
+		if (t->due <= now)
+			t->due += ((now - t->due) / t->period + 1) * t->period;
+		if (activity && (t->flags & SCHED_ACTIVITY)) {
+			if (t->baseline)
+				t->baseline(t, now);
+			t->skipped++;
+		}
+		else if (t->flags & SCHED_ACTIVITY) {
+			long long start = now_ns();
+			int hit = (t->run(t, now) != 0);
+			double cost = now_ns() - start;
+			if (t->cost == 0) {
+				t->cost = cost;
+				t->hit_rate = hit;
+			}
+			else {
+				t->cost += SCHED_EWMA * (cost - t->cost);
+				t->hit_rate += SCHED_EWMA * (hit - t->hit_rate);
+			}
+			activity |= hit;
+		}
+		else {
+			t->run(t, now);
+		}
+		t->last = now;
+		heap_push(t);
+	}
+	return nrun;
+}
@@ -0,0 +1,40 @@
+/*
+ * A per-source sampling scheduler for sleepd
+ * (not Threadsafe!)
+ */
+
+#include <limits.h>
+
+#define SCHED_MAXTASKS 32
+/* due time of a parked task */
+#define SCHED_NEVER LLONG_MAX
+
+/* task flags */
+#define SCHED_ACTIVITY 0x1	/* an activity check, see sched_run */
+
+struct sched_task
+{
+	const char *name;
+	long long period;	/* in ms */
+	long long jitter;	/* in ms, the task may run this much early to share a wakeup */
+	/* returns 1 if activity was seen */
+	int (*run)(struct sched_task *task, long long now);
+	/* optional, refreshes the state of an activity check without
+	 * evaluating it, used when another check already found activity */
+	void (*baseline)(struct sched_task *task, long long now);
+	unsigned int flags;
+
+	/* managed by the scheduler */
+	long long due;		/* CLOCK_MONOTONIC in ms */
+	long long last;		/* time of the previous run, 0 if it never ran */
+	unsigned int order;	/* tasks due at the same wakeup run in order of sched_add */
+	int idx;		/* heap index, -1 if not scheduled */
+	double cost;		/* average run time in ns */
+	double hit_rate;	/* average fraction of runs that saw activity */
+	unsigned int skipped;	/* runs skipped since activity was known */
+};
+
+extern long long sched_now (void);
+extern int sched_add (struct sched_task *task, long long due);
+extern void sched_set_due (struct sched_task *task, long long due);
+extern int sched_run (void);
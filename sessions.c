@@ -0,0 +1,248 @@
+/*
+ * utmp login session activity source for sleepd
+ *
+ * The ttys of all logged in users are watched with inotify, a read on any
+ * of them (input) is activity. Output is not, or top or tail -f in a
+ * forgotten terminal would keep the machine awake. utmp is watched as well and only parsed again
+ * when it changes. Without inotify, the access time of the ttys is used like
+ * w(1) does: they are kept open (O_PATH, which does not touch them) and need
+ * an fstat per sample.
+ */
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <utmp.h>
+
+#include "sched.h"
+#include "activity.h"
+#include "sessions.h"
+
+#define UTMP_EVENTS (IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF)
+#define TTY_EVENTS IN_ACCESS
+
+struct session
+{
+	char tty[5 + UT_LINESIZE + 1];
+	int fd;
+	int wd;			/* inotify watch, -1 if none */
+	long long last_active;	/* CLOCK_MONOTONIC in ms */
+};
+
+static unsigned char use_utmp = 0;
+static struct session *sessions = NULL;
+static int nsessions = 0;
+static int session_size = 0;
+static int inotify_fd = -1;
+static int utmp_wd = -1;
+/* utmp has to be parsed again */
+static unsigned char utmp_changed = 1;
+
+
+void utmp_enable (void) {
+	use_utmp = 1;
+}
+
+/**** stat the device file to get an idle time */
+// Copied from w.c in procps by Charles Blake
+static int idletime (int fd) {
+	struct stat sbuf;
+	if (fstat(fd, &sbuf) != 0)
+		return -1;
+	return (int)(time(NULL) - sbuf.st_atime);
+}
+
+static int add_session (const char *tty, long long now) {
+	struct session *s;
+	int idle;
+	int i;
+
+	for (i = 0; i < nsessions; i++) {
+		if (strcmp(sessions[i].tty, tty) == 0)
+			return 0;
+	}
+	if (nsessions == session_size) {
+		int size = session_size ? session_size * 2 : 8;
+		struct session *s = realloc(sessions, size * sizeof(*s));
+		if (!s)
+			return -1;
+		sessions = s;
+		session_size = size;
+	}
+	/* A pts number may be reused by a new session, so the ttys are
+	 * opened again each time. */
+	s = &sessions[nsessions];
+	s->fd = open(tty, O_PATH | O_CLOEXEC);
+	if (s->fd < 0)
+		return 0;
+	strcpy(s->tty, tty);
+	/* from now on inotify tells, up to now the access time */
+	s->wd = inotify_fd >= 0 ? inotify_add_watch(inotify_fd, tty, TTY_EVENTS) : -1;
+	idle = idletime(s->fd);
+	s->last_active = idle >= 0 ? now - idle * 1000LL : 0;
+	nsessions++;
+	return 0;
+}
+
+static void close_sessions (void) {
+	int i;
+
+	for (i = 0; i < nsessions; i++) {
+		if (sessions[i].wd >= 0)
+			inotify_rm_watch(inotify_fd, sessions[i].wd);
+		close(sessions[i].fd);
+	}
+	nsessions = 0;
+}
+
+/* Parse utmp into the session list. */
+static void read_utmp (long long now) {
+	typedef struct utmp utmp_t;
+	utmp_t *u;
+	unsigned i;
+
+	close_sessions();
+	utmpname(UTMP_FILE);
+	setutent();
+	while ((u = getutent())) {
+		if (u->ut_type == USER_PROCESS) {
+			/* get tty. From w.c in procps by Charles Blake. */
+			char tty[5 + sizeof u->ut_line + 1] = "/dev/";
+			for (i=0; i < sizeof u->ut_line; i++) {
+				/* clean up tty if garbled */
+				if (isalnum(u->ut_line[i]) ||
+				    (u->ut_line[i] == '/')) {
+					tty[i+5] = u->ut_line[i];
+				}
+				else {
+					tty[i+5] = '\0';
+				}
+			}
+			if (add_session(tty, now) != 0)
+				break;
+		}
+	}
+	endutent();
+	if (debug)
+		printf("sleepd: utmp: %d sessions\n", nsessions);
+}
+
+/* Drain the inotify events, utmp may have been replaced by a new file. */
+static void check_inotify (long long now) {
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	ssize_t len;
+
+	if (inotify_fd < 0) {
+		/* no inotify, parse every time */
+		utmp_changed = 1;
+		return;
+	}
+	while ((len = read(inotify_fd, buf, sizeof(buf))) > 0) {
+		char *p;
+		for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+			struct inotify_event *ev = (struct inotify_event *)p;
+			if (ev->wd != utmp_wd) {
+				int i;
+				/* the watches of ended sessions report IN_IGNORED */
+				for (i = 0; i < nsessions; i++) {
+					if (sessions[i].wd == ev->wd) {
+						if (ev->mask & TTY_EVENTS)
+							sessions[i].last_active = now;
+						break;
+					}
+				}
+				continue;
+			}
+			utmp_changed = 1;
+			if (ev->mask & (IN_MOVE_SELF | IN_DELETE_SELF | IN_IGNORED)) {
+				if (!(ev->mask & IN_IGNORED))
+					inotify_rm_watch(inotify_fd, utmp_wd);
+				utmp_wd = -1;
+			}
+		}
+	}
+	if (utmp_wd < 0) {
+		utmp_wd = inotify_add_watch(inotify_fd, UTMP_FILE, UTMP_EVENTS);
+		utmp_changed = 1;
+	}
+}
+
+/* Returns the last activity of all sessions, 0 if there is none. */
+static long long check_utmp (long long now) {
+	long long last = 0;
+	int i;
+
+	check_inotify(now);
+	if (utmp_changed) {
+		utmp_changed = 0;
+		read_utmp(now);
+	}
+	for (i = 0; i < nsessions; i++) {
+		struct session *s = &sessions[i];
+		if (s->wd < 0) {
+			int idle = idletime(s->fd);
+			if (idle >= 0 && now - idle * 1000LL > s->last_active)
+				s->last_active = now - idle * 1000LL;
+		}
+		if (s->last_active > last)
+			last = s->last_active;
+	}
+	return last;
+}
+
+static int utmp_init (struct activity_source *src) {
+	if (!use_utmp)
+		return 0;
+	inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (inotify_fd < 0)
+		perror("sleepd: inotify");
+	utmp_changed = 1;
+	return 1;
+}
+
+/* inotify wakes us up on tty activity and utmp changes. */
+static int utmp_fd (struct activity_source *src) {
+	return inotify_fd;
+}
+
+/* Called for every batch of tty events, so only newly seen activity is
+ * printed. */
+static int utmp_sample (struct activity_source *src, long long now, int baseline) {
+	/* The most recent session is the real idle time */
+	long long active = check_utmp(now);
+
+	if (active > src->last_active) {
+		if (debug && active - src->last_active >= 1000)
+			printf("sleepd: activity: utmp %lld seconds\n", (now - active) / 1000);
+		src->last_active = active;
+	}
+	return 0;
+}
+
+static void utmp_teardown (struct activity_source *src) {
+	close_sessions();
+	free(sessions);
+	sessions = NULL;
+	session_size = 0;
+	if (inotify_fd >= 0)
+		close(inotify_fd);
+	inotify_fd = utmp_wd = -1;
+}
+
+struct activity_source utmp_source = {
+	.name = "utmp",
+	.flags = ACT_DEFERRED | ACT_IDLE,
+	.init = utmp_init,
+	.fd = utmp_fd,
+	.sample = utmp_sample,
+	.teardown = utmp_teardown,
+};
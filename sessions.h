@@ -0,0 +1,8 @@
+/*
+ * utmp login session activity source for sleepd
+ * (not Threadsafe!)
+ */
+
+extern struct activity_source utmp_source;
+
+extern void utmp_enable (void);
@@ -21,6 +21,8 @@
 
 void cleanup_and_exit(int ret) __attribute__((noreturn));
 
+static int notify = 0;
+
 void usage (void) {
 	printf("sleepctl %d.%d\n", PKG_VERSION_MAJOR, PKG_VERSION_MINOR);
 	fprintf(stderr, "Usage: sleepctl [on|off|xon|xoff|status|xdiff [XxY WxH]]\n");
@@ -67,6 +69,10 @@ void show_status (struct ipc_data *id) {
 
 void cleanup_and_exit(int ret) {
 	ipc_unlock();
+	/* Wake up sleepd, so changes take effect immediately. If this fails
+	 * (e.g. not permitted), they are picked up on its next check. */
+	if (notify)
+		ipc_notify_master();
         ipc_close_slave();
 	exit(ret);
 }
@@ -122,10 +128,12 @@ int main (int argc, char **argv) {
 
 	if (strcmp(argv[1],"on") == 0) {
 		SET_FLAG(id, FLG_ENABLED);
+		notify = 1;
 		show_status(id);
 	}
 	else if (strcmp(argv[1],"off") == 0) {
 		UNSET_FLAG(id, FLG_ENABLED);
+		notify = 1;
 		show_status(id);
 	}
 	else if (strcmp(argv[1],"xon") == 0) {
@@ -134,6 +142,7 @@ int main (int argc, char **argv) {
 				strncpy(&id->xdisplay[0], getenv("DISPLAY"), IPC_XDISPMAX);
 				strncpy(&id->xauthority[0], getenv("XAUTHORITY"), IPC_PATHMAX);
 				SET_FLAG(id, FLG_USEX11);
+				notify = 1;
 				show_status(id);
 			}
 			else printf("sleepctl: Environment variables DISPLAY or XAUTHORITY not set.\n");
@@ -143,6 +152,7 @@ int main (int argc, char **argv) {
 	else if (strcmp(argv[1],"xoff") == 0) {
 		if (GET_FLAG(id, FLG_HASX11) != 0) {
 			UNSET_FLAG(id, FLG_USEX11);
+			notify = 1;
 			memset(&id->xauthority[0], '\0', IPC_PATHMAX);
 			memset(&id->xdisplay[0], '\0', IPC_XDISPMAX);
 			show_status(id);
@@ -163,6 +173,7 @@ int main (int argc, char **argv) {
 			id->xdiff_bounds[1] = y;
 			id->xdiff_bounds[2] = w;
 			id->xdiff_bounds[3] = h;
+			notify = 1;
 		}
 	}
 	else {
@@ -7,15 +7,15 @@
  */
 
 #include <sys/types.h>
+#include <sys/epoll.h>
 #include <sys/file.h>
+#include <sys/signalfd.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 
-#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
-#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -23,8 +23,8 @@
 #include <syslog.h>
 #include <time.h>
 #include <unistd.h>
-#include <utmp.h>
 #include <grp.h>
+#include <math.h>
 
 #include "apm.h"
 #include "acpi.h"
@@ -39,7 +39,22 @@
 #include <pwd.h>
 #include "xutils.h"
 #endif
+#include "reactor.h"
+#include "resume.h"
+#include "sched.h"
+#include "activity.h"
+#include "audio.h"
+#include "cgroup.h"
+#include "disks.h"
 #include "eventmonitor.h"
+#include "irqs.h"
+#include "loadavg.h"
+#include "netdev.h"
+#include "procs.h"
+#include "sockdiag.h"
+#include "sessions.h"
+#include "thermal.h"
+#include "uevent.h"
 #include "sleepd.h"
 #include "ipc.h"
 
@@ -48,11 +63,7 @@
 #define ENV_LEN 1024
 
 
-static int irqs[MAX_IRQS];		/* irqs to examine have a value of 1 */
-static unsigned char autoprobe = 1;
-static unsigned char have_irqs = 0;
 static unsigned char use_events = 1;
-static pthread_t emthread;
 static int max_unused = MAX_UNUSED;	/* in seconds */
 static int ac_max_unused = 0;
 #ifdef USE_APM
@@ -65,6 +76,8 @@ static unsigned char daemonize = 1;
 static int sleep_time = DEFAULT_SLEEP_TIME;
 static unsigned char no_sleep=0;
 static int min_batt=-1;
+static int min_batt_time = 0;	/* minutes left, 0 if not used */
+static int batt_hysteresis = BATTERY_HYSTERESIS;	/* percent */
 #ifdef HAL
 static unsigned char use_simplehal = 0;
 #endif
@@ -74,29 +87,24 @@ static unsigned char use_upower = 0;
 static unsigned char use_acpi = 0;
 static unsigned char force_hal = 0;
 static unsigned char require_unused_and_battery = 0;	/* --and or -A option */
-static double max_loadavg = 0;
-static unsigned char use_utmp = 0;
-static unsigned char use_net = 0;
-static int min_tx[MAX_NET]; 
-static int min_rx[MAX_NET];
-static unsigned char net_samples[MAX_NET];		/* net samples for rx/tx per netdev */
-static size_t net_samples_idx = 0;			/* current index of net_samples */
-static unsigned int net_samples_rx[MAX_NET][MAX_SAMPLES]; /* save rx samples[net_samples_idx] */
-static unsigned int net_samples_tx[MAX_NET][MAX_SAMPLES]; /* save tx samples[net_samples_idx] */
-static char netdevtx[MAX_NET][45];
-static char netdevrx[MAX_NET][45];
 #ifdef X11
 static unsigned char use_x = 0;
 static unsigned int use_xdiff = 0;
 static int xmax_unused = 0;
 static int xdiff_max_unused = 0;
+static char xauthority[IPC_PATHMAX+1];
+static char xdisplay[IPC_XDISPMAX+1];
+static unsigned int x_bounds[4];
+static XImage *x_oldimg = NULL;
 #endif
 static gid_t shm_grp = 0;
-static unsigned char debug = 0;
+unsigned char debug = 0;
+
+struct sched_task *find_task (const char *name, size_t len);
 
 
 void usage (char *arg0) {
-	fprintf(stderr, "Usage: sleepd [-s command] [-d command] [-u n] [-U n] [-I] [-i n] [-E] [-e filename] [-a] [-l n] [-w] [-n] [-v] [-c n] [-b n] [-A] [-H] [-N [dev] [-t n] [-r n] -s n] [-x n] [-X] [-g name] [--xdiff-unused n] [-V] [-h]\n\n");
+	fprintf(stderr, "Usage: sleepd [-s command] [-d command] [-u n] [-U n] [-I] [-i n] [-E] [-e filename] [-a] [-l n] [--pressure resource[=n:n]] [-w] [-n] [-v] [-c n] [-b n] [--battery-time n] [--battery-hysteresis n] [-A] [-H] [-N [dev] [-t n] [-r n] [--tx-bytes n] [--rx-bytes n] [-m n] [--net-halflife n]] [--socket rule] [--cgroup path[,cpu=n][,io=n]] [--process name[|name]] [--disk dev[,sectors=n]] [--audio] [--thermal [zone=type][,rise=n[:s]][,hibernate=n]] [-x n] [-X] [-g name] [--xdiff-unused n] [--period source=n[:j]] [-V] [-h]\n\n");
 }
 
 void parse_command_line (int argc, char **argv) {
@@ -127,6 +135,19 @@ void parse_command_line (int argc, char **argv) {
 		{"xdiff", 1, NULL, 'X'},
 		{"xdiff-unused", 1, NULL, 2},
 		{"group", 1, NULL, 'g'},
+		{"period", 1, NULL, 3},
+		{"tx-bytes", 1, NULL, 4},
+		{"rx-bytes", 1, NULL, 5},
+		{"net-halflife", 1, NULL, 6},
+		{"socket", 1, NULL, 7},
+		{"pressure", 1, NULL, 8},
+		{"cgroup", 1, NULL, 9},
+		{"process", 1, NULL, 10},
+		{"disk", 1, NULL, 11},
+		{"audio", 0, NULL, 12},
+		{"battery-time", 1, NULL, 13},
+		{"battery-hysteresis", 1, NULL, 14},
+		{"thermal", 1, NULL, 15},
 		{"force-hal", 0, NULL, 'H'},
 		{"force-upower", 0, NULL, 1},
 		{"version", 0, NULL, 'V'},
@@ -140,16 +161,6 @@ void parse_command_line (int argc, char **argv) {
 	int event = 0;
 	int netcount = 0;
 	int result;
-	char tmpdev[9];
-	char tx_statfile[44];
-	char rx_statfile[44];
-	unsigned char tx_set[MAX_NET];
-	unsigned char rx_set[MAX_NET];
-	unsigned char sm_set[MAX_NET];
-
-	memset(&tx_set[0], '\0', MAX_NET*sizeof(char));
-	memset(&rx_set[0], '\0', MAX_NET*sizeof(char));
-	memset(&sm_set[0], '\0', MAX_NET*sizeof(char));
 
 	while (c != -1) {
 		c = getopt_long(argc,argv, "s:d:nvu:U:l:wIi:Ee:Vhac:b:AN:r:t:x:X:m:g:H", long_options, NULL);
@@ -189,24 +200,29 @@ void parse_command_line (int argc, char **argv) {
 				}
 				break;
 			case 'l':
-				max_loadavg = atof(optarg);
+				load_set_max(atof(optarg));
 				break;
 			case 'w':
-				use_utmp = 1;
+				utmp_enable();
 				break;
 			case 1:
 			case 'H':
 				force_hal = 1;
 				break;
 			case 'i':
+				if (optarg[strspn(optarg, "0123456789")] != '\0') {
+					/* a device name pattern */
+					if (irq_watch_name(optarg) != 0) {
+						fprintf(stderr, "sleepd: too many irq names\n");
+						exit(1);
+					}
+					break;
+				}
 				i = atoi(optarg);
-				if ((i < 0) || (i >= MAX_IRQS)) {
+				if (irq_watch(i) != 0) {
 					fprintf(stderr, "sleepd: bad irq number %d\n", i);
 					exit(1);
 				}
-				irqs[atoi(optarg)] = 1;
-				autoprobe = 0;
-				have_irqs = 1;
 				break;
 			case 'e':
 				result = access(optarg, R_OK);
@@ -264,59 +280,110 @@ void parse_command_line (int argc, char **argv) {
 					exit(1);
 				}
 				break;
-			case 'N':
-				if (netcount >= MAX_NET) {
-					fprintf(stderr, "sleepd: only %d net devices allowed (check '-N' args)\n", MAX_NET);
+			case 13:
+				min_batt_time = atoi(optarg);
+				if (min_batt_time <= 0) {
+					fprintf(stderr, "sleepd: bad minimum battery time %s\n", optarg);
 					exit(1);
 				}
-				memset(&tmpdev[0], '\0', ARRAY_SIZE(tmpdev));
-				strncpy(tmpdev, optarg, 8);
-				snprintf(tx_statfile, ARRAY_SIZE(tx_statfile), TXFILE, tmpdev);
-				snprintf(rx_statfile, ARRAY_SIZE(rx_statfile), RXFILE, tmpdev);
-				if ((access(tx_statfile, R_OK) == 0) &&
-				    (access(rx_statfile, R_OK) == 0)) {
-					memset(&netdevtx[netcount][0], '\0', ARRAY_SIZE(netdevtx[netcount]));
-					memset(&netdevrx[netcount][0], '\0', ARRAY_SIZE(netdevrx[netcount]));
-					strncpy(netdevtx[netcount], tx_statfile, 44);
-					strncpy(netdevrx[netcount], rx_statfile, 44);
-					use_net = 1;
-					netcount++;
-				} else {
-					fprintf(stderr, "sleepd: %s not found in sysfs\n", tmpdev);
+				break;
+			case 14:
+				batt_hysteresis = atoi(optarg);
+				if (batt_hysteresis < 0 || batt_hysteresis > 100) {
+					fprintf(stderr, "sleepd: bad battery hysteresis %s\n", optarg);
+					exit(1);
+				}
+				break;
+			case 15:
+				if (thermal_add(optarg) != 0) {
+					fprintf(stderr, "sleepd: bad --thermal %s\n", optarg);
 					exit(1);
 				}
 				break;
+			case 'N':
+				if (net_add_device(optarg) < 0) {
+					perror("sleepd: -N");
+					exit(1);
+				}
+				netcount++;
+				break;
 			case 't':
-				if (netcount > 0 && tx_set[netcount-1] == 0) {
-					min_tx[netcount-1] = atoi(optarg);
-					tx_set[netcount-1] = 1;
-				} else {
+				if (netcount == 0 || net_set_min_tx(netcount-1, atoi(optarg)) != 0) {
 					fprintf(stderr, "sleepd: you can use '-%c' only ONCE and AFTER the corresponding '-N'\n", 't');
 					exit(1);
 				}
 				break;
 			case 'r':
-				if (netcount > 0 && rx_set[netcount-1] == 0) {
-					min_rx[netcount-1] = atoi(optarg);
-					rx_set[netcount-1] = 1;
-				} else {
+				if (netcount == 0 || net_set_min_rx(netcount-1, atoi(optarg)) != 0) {
 					fprintf(stderr, "sleepd: you can use '-%c' only ONCE and AFTER the corresponding '-N'\n", 'r');
 					exit(1);
 				}
 				break;
 			case 'm':
-				if (netcount > 0 && sm_set[netcount-1] == 0) {
-					net_samples[netcount-1] = atoi(optarg);
-					if (net_samples[netcount-1] <= 1 || net_samples[netcount-1] > MAX_SAMPLES) {
-						fprintf(stderr, "sleepd: net samples should be between 2 and %d\n", MAX_SAMPLES);
-						exit(1);
-					}
-					sm_set[netcount-1] = 1;
-				} else {
+				if (atoi(optarg) <= 1 || atoi(optarg) > MAX_SAMPLES) {
+					fprintf(stderr, "sleepd: net samples should be between 2 and %d\n", MAX_SAMPLES);
+					exit(1);
+				}
+				if (netcount == 0 || net_set_samples(netcount-1, atoi(optarg)) != 0) {
 					fprintf(stderr, "sleepd: you can use '-%c' only ONCE and AFTER the corresponding '-N'\n", 'm');
 					exit(1);
 				}
 				break;
+			case 4:
+				if (netcount == 0 || net_set_min_tx_bytes(netcount-1, atoll(optarg)) != 0) {
+					fprintf(stderr, "sleepd: you can use '--tx-bytes' only ONCE and AFTER the corresponding '-N'\n");
+					exit(1);
+				}
+				break;
+			case 5:
+				if (netcount == 0 || net_set_min_rx_bytes(netcount-1, atoll(optarg)) != 0) {
+					fprintf(stderr, "sleepd: you can use '--rx-bytes' only ONCE and AFTER the corresponding '-N'\n");
+					exit(1);
+				}
+				break;
+			case 6:
+				if (atof(optarg) <= 0) {
+					fprintf(stderr, "sleepd: bad net half-life %s\n", optarg);
+					exit(1);
+				}
+				if (netcount == 0 || net_set_halflife(netcount-1, atof(optarg)) != 0) {
+					fprintf(stderr, "sleepd: you can use '--net-halflife' only ONCE and AFTER the corresponding '-N'\n");
+					exit(1);
+				}
+				break;
+			case 7:
+				if (sock_add_rule(optarg) != 0) {
+					fprintf(stderr, "sleepd: bad socket rule %s\n", optarg);
+					exit(1);
+				}
+				break;
+			case 8:
+				if (psi_add_trigger(optarg) != 0) {
+					fprintf(stderr, "sleepd: bad pressure trigger %s\n", optarg);
+					exit(1);
+				}
+				break;
+			case 9:
+				if (cgroup_add(optarg) != 0) {
+					fprintf(stderr, "sleepd: bad cgroup %s\n", optarg);
+					exit(1);
+				}
+				break;
+			case 10:
+				if (proc_add_pattern(optarg) != 0) {
+					fprintf(stderr, "sleepd: bad process list %s\n", optarg);
+					exit(1);
+				}
+				break;
+			case 11:
+				if (disk_add(optarg) != 0) {
+					fprintf(stderr, "sleepd: bad disk %s\n", optarg);
+					exit(1);
+				}
+				break;
+			case 12:
+				audio_enable();
+				break;
 			case 'A':
 				require_unused_and_battery = 1;
 				break;
@@ -345,6 +412,29 @@ void parse_command_line (int argc, char **argv) {
 				fprintf(stderr, "sleepd: x11 diff check disabled\n");
 #endif
 				break;
+			case 3:
+				{
+					/* name=seconds[:jitter] */
+					char *eq = strchr(optarg, '=');
+					char *end = NULL;
+					struct sched_task *t = eq ? find_task(optarg, eq - optarg) : NULL;
+					double period, jitter = -1;
+					if (!t) {
+						fprintf(stderr, "sleepd: unknown source in --period %s\n", optarg);
+						exit(1);
+					}
+					period = strtod(eq + 1, &end);
+					if (end && *end == ':')
+						jitter = strtod(end + 1, &end);
+					if (!end || *end != '\0' || period < 0.1 || (jitter != -1 && jitter < 0)) {
+						fprintf(stderr, "sleepd: bad --period %s\n", optarg);
+						exit(1);
+					}
+					t->period = (long long)(period * 1000);
+					if (jitter != -1)
+						t->jitter = (long long)(jitter * 1000);
+				}
+				break;
 			case 'g':
 				{
 					struct group *grp = getgrnam(optarg);
@@ -367,18 +457,14 @@ void parse_command_line (int argc, char **argv) {
 	if (use_events) {
 		strncpy(eventData.events[event], "", 1);
 	}
-
-	if (use_net) {
-		strncpy(netdevtx[netcount], "", 1);
-		strncpy(netdevrx[netcount], "", 1);
-	}
+	eventData.enabled = use_events;
 
 	if (noirq) {
-		autoprobe = 0;
+		irq_set_autoprobe(0);
 	}
 
 	if (force_autoprobe) {
-		autoprobe = 1;
+		irq_set_autoprobe(1);
 	}
 
 #ifdef X11
@@ -388,172 +474,6 @@ void parse_command_line (int argc, char **argv) {
 #endif
 }
 
-/**** stat the device file to get an idle time */
-// Copied from w.c in procps by Charles Blake
-int idletime (const char *tty) {
-	struct stat sbuf;
-	if (stat(tty, &sbuf) != 0)
-		return 0;
-	return (int)(time(NULL) - sbuf.st_atime);
-}
-
-unsigned char check_irqs (unsigned char activity, unsigned char autoprobe) {
-	static long irq_count[MAX_IRQS]; /* holds previous counters of the irqs */
-	static int probed = 0;
-	static int no_dev_warned = 0;
-
-	FILE *f;
-	char line[64];
-	int i;
-
-	f=fopen(INTERRUPTS, "r");
-	if (! f) {
-		perror(INTERRUPTS);
-		exit(1);
-	}
-	while (fgets(line,sizeof(line),f)) {
-		long v;
-		int do_this_one = 0;
-		if (autoprobe) {
-			/* Lowercase line. */
-			for(i = 0; line[i]; i++)
-				line[i] = tolower(line[i]);
-			/* See if it is a keyboard or mouse. */
-			if (strstr(line, "mouse") != NULL ||
-			    strstr(line, "keyboard") != NULL ||
-			    /* 2.5 kernels report by chipset,
-			     * this is a ps/2 keyboard/mouse. */
-			    strstr(line, "i8042") != NULL) {
-				do_this_one = 1;
-				probed = 1;
-			}
-		}
-		if (sscanf(line,"%d: %ld",&i, &v) == 2 &&
-		    i < MAX_IRQS && i >= 0 &&
-		    (do_this_one || irqs[i]) && irq_count[i] != v) {
-			if (debug)
-				printf("sleepd: activity: irq %d\n", i);
-			activity = 1;
-			irq_count[i] = v;
-		}
-	}
-	fclose(f);
-	
-	if (autoprobe && ! probed) {
-		if (! no_dev_warned) {
-			no_dev_warned = 1;
-			syslog(LOG_WARNING, "no keyboard or mouse irqs autoprobed");
-		}
-	}
-
-	return activity;
-}
-
-unsigned char check_net (unsigned char activity) {
-	static long tx_count[MAX_NET]; /* holds previous counters of tx packets */
-	static long rx_count[MAX_NET]; /* holds previous counters of rx packets */
-
-	long tx, rx;
-	int i;
-	for (i=0; i < MAX_NET; i++) {
-		if (strncmp(netdevtx[i], "", 1) != 0) {
-			char line[64];
-			FILE *f = fopen(netdevtx[i], "r");
-			if (fgets(line,sizeof(line),f)) {
-				tx = strtol(line, (char **) NULL, 10);
-			}
-			else {
-				fprintf(stderr, "sleepd: could not read %s\n", netdevtx[i]);
-				exit(1);
-			}
-			fclose(f);
-			f = fopen(netdevrx[i], "r");
-			if (fgets(line,sizeof(line),f)) {
-				rx = strtol(line, (char **) NULL, 10);
-			}
-			else {
-				fprintf(stderr, "sleepd: could not read %s\n", netdevrx[i]);
-				exit(1);
-			}
-			fclose(f);
-
-			if (net_samples[i] > 1) {
-				net_samples_tx[i][net_samples_idx] = (tx - tx_count[i])/sleep_time;
-				net_samples_rx[i][net_samples_idx] = (rx - rx_count[i])/sleep_time;
-				if (++net_samples_idx >= net_samples[i]) {
-					net_samples_idx = 0;
-				}
-
-				long sum_tx = 0;
-				long sum_rx = 0;
-				size_t j = 0;
-				for (j = 0; j < net_samples[i]; ++j) {
-					sum_tx += net_samples_tx[i][j];
-					sum_rx += net_samples_rx[i][j];
-				}
-				long avg_tx = sum_tx/net_samples[i];
-				long avg_rx = sum_rx/net_samples[i];
-
-				if ((avg_tx > min_tx[i]) || avg_rx > min_rx[i]) {
-					if (debug) {
-						printf("sleepd: activity: avg network rx/tx rate calculation (%d samples): txrate: %ld rxrate: %ld\n", net_samples[i], avg_tx, avg_rx);
-					}
-					activity = 1;
-				}
-			} else
-			if (((tx - tx_count[i])/sleep_time > min_tx[i]) ||
-			    ((rx - rx_count[i])/sleep_time > min_rx[i])) {
-				if (debug) {
-					printf("sleepd: activity: network txrate: %ld rxrate: %ld\n",
-						(tx - tx_count[i])/sleep_time, (rx - rx_count[i])/sleep_time);
-				}
-				activity = 1;
-			}
-			tx_count[i] = tx;
-			rx_count[i] = rx;
-		} else {
-			break;
-		}
-	}
-
-	return activity;
-}
-
-int check_utmp (int total_unused) {
-	/* replace total_unused with the minimum of
-	 * total_unused and the shortest utmp idle time. */
-	typedef struct utmp utmp_t;
-	utmp_t *u;
-	int min_idle = 2 * max_unused;
-	utmpname(UTMP_FILE);
-	setutent();
-	while ((u = getutent())) {
-		if (u->ut_type == USER_PROCESS) {
-			/* get tty. From w.c in procps by Charles Blake. */
-			char tty[5 + sizeof u->ut_line + 1] = "/dev/";
-			unsigned i;
-			for (i=0; i < sizeof u->ut_line; i++) {
-				/* clean up tty if garbled */
-				if (isalnum(u->ut_line[i]) ||
-				    (u->ut_line[i] == '/')) {
-					tty[i+5] = u->ut_line[i];
-				}
-				else {
-					tty[i+5] = '\0';
-				}
-			}
-			int cur_idle = idletime(tty);
-			min_idle = (cur_idle < min_idle) ? cur_idle : min_idle;
-		}
-	}
-	/* The shortest idle time is the real idle time */
-	total_unused = (min_idle < total_unused) ? min_idle : total_unused;
-	if (debug && total_unused == min_idle)
-		printf("sleepd: activity: utmp %d seconds\n", min_idle);
-
-	return total_unused;
-}
-
 char *safe_env (const char *name)
 {
 	if (! name)
@@ -584,6 +504,11 @@ int safe_exec (const char *cmdWithArgs, int total_unused)
 		return -2;
 	pid_t child;
 	if ( (child = fork()) == 0 ) {
+		/* execve keeps the signal mask, don't leak the blocked
+		 * IPC_NOTIFY_SIG into the sleep command. */
+		sigset_t mask;
+		sigemptyset(&mask);
+		sigprocmask(SIG_SETMASK, &mask, NULL);
 
 		int szCur = 0, szMax = 10;
 		char **args = calloc(szMax, sizeof(char *));
@@ -649,327 +574,582 @@ int safe_exec (const char *cmdWithArgs, int total_unused)
 	return -4;
 }
 
-void main_loop (void) {
-	unsigned char activity = 0, sleep_now = 0;
-        int total_unused = 0;
-#ifdef X11
-	char xauthority[IPC_PATHMAX+1];
-	char xdisplay[IPC_XDISPMAX+1];
-	int x_unused = 0;
-	unsigned int x_bounds[4];
-	XImage *x_oldimg = NULL;
-	int xdiff_unused = 0;
-#endif
-	int sleep_battery = 0;
-	int prev_ac_line_status = -1;
-	time_t nowtime, oldtime = 0;
-	apm_info ai;
-	double loadavg[1];
-
-	unsetenv("SLEEPD_XUSER");
-	unsetenv("DISPLAY");
-	unsetenv("XAUTHORITY");
-
-	memset(&ai, '\0', sizeof(ai));
-#ifdef X11
-	memset(&x_bounds[0], '\0', sizeof(x_bounds));
-#endif
+void wake_tick (void);
 
-	if (use_events) {
-		pthread_create(&emthread, NULL, eventMonitor, NULL);
-	}
-
-	while (1) {
-		if (ipc_lock() == 0) {
-			struct ipc_data *id_ptr = NULL;
-			ipc_getshmptr(&id_ptr);
-			if (id_ptr != NULL) {
-				no_sleep = (GET_FLAG(id_ptr, FLG_ENABLED) == 0);
+/* Pick up changes made by sleepctl in the shared memory segment. */
+void sync_ipc (void) {
+	if (ipc_lock() == 0) {
+		struct ipc_data *id_ptr = NULL;
+		ipc_getshmptr(&id_ptr);
+		if (id_ptr != NULL) {
+			no_sleep = (GET_FLAG(id_ptr, FLG_ENABLED) == 0);
 #ifdef X11
-				if (GET_FLAG(id_ptr, FLG_USEX11) != 0) {
-					memset(&xauthority[0], '\0', ARRAY_SIZE(xauthority));
-					memset(&xdisplay[0], '\0', ARRAY_SIZE(xdisplay));
-					strncpy(&xauthority[0], &id_ptr->xauthority[0], IPC_PATHMAX);
-					strncpy(&xdisplay[0], &id_ptr->xdisplay[0], IPC_XDISPMAX);
-					setenv("XAUTHORITY", &xauthority[0], 1);
-					setenv("DISPLAY", &xdisplay[0], 1);
-
-					if (!use_x) {
-						if (debug) {
-							printf("sleepd: x11 idle check enabled (DISPLAY: %s , XAUTHORITY: %s)\n", &xdisplay[0], &xauthority[0]);
-						}
-						struct stat st;
-						if (stat(&xauthority[0], &st) == 0) {
-							struct passwd *pwd = NULL;
-							if ((pwd = getpwuid(st.st_uid)) != NULL) {
-								setenv("SLEEPD_XUSER", pwd->pw_name, 1);
-								if (debug) {
-									printf("sleepd: xauth owner: %s\n", pwd->pw_name);
-								}
+			if (GET_FLAG(id_ptr, FLG_USEX11) != 0) {
+				memset(&xauthority[0], '\0', ARRAY_SIZE(xauthority));
+				memset(&xdisplay[0], '\0', ARRAY_SIZE(xdisplay));
+				strncpy(&xauthority[0], &id_ptr->xauthority[0], IPC_PATHMAX);
+				strncpy(&xdisplay[0], &id_ptr->xdisplay[0], IPC_XDISPMAX);
+				setenv("XAUTHORITY", &xauthority[0], 1);
+				setenv("DISPLAY", &xdisplay[0], 1);
+
+				if (!use_x) {
+					if (debug) {
+						printf("sleepd: x11 idle check enabled (DISPLAY: %s , XAUTHORITY: %s)\n", &xdisplay[0], &xauthority[0]);
+					}
+					struct stat st;
+					if (stat(&xauthority[0], &st) == 0) {
+						struct passwd *pwd = NULL;
+						if ((pwd = getpwuid(st.st_uid)) != NULL) {
+							setenv("SLEEPD_XUSER", pwd->pw_name, 1);
+							if (debug) {
+								printf("sleepd: xauth owner: %s\n", pwd->pw_name);
 							}
 						}
-						if (init_x11() != 0) {
-							syslog(LOG_ERR, "X11 init failed.\n");
-							UNSET_FLAG(id_ptr, FLG_USEX11);
-						}
-						if (use_xdiff && check_x11_bounds(x_bounds) != 0) {
-							syslog(LOG_ERR, "X11 diff using default bounds.\n");
-						}
 					}
-
-					if (use_xdiff && memcmp(&x_bounds[0], &id_ptr->xdiff_bounds[0], sizeof(x_bounds)) != 0) {
-						memcpy(&x_bounds[0], &id_ptr->xdiff_bounds[0], sizeof(x_bounds));
-						if (check_x11_bounds(x_bounds) != 0) {
-							syslog(LOG_ERR, "X11 bounds check failed, using default.\n");
-							memcpy(&id_ptr->xdiff_bounds[0], &x_bounds[0], sizeof(x_bounds));
-						}
-						if (x_oldimg) {
-							XDestroyImage(x_oldimg);
-							x_oldimg = NULL;
-						}
-						if (debug) {
-							printf("sleepd: X11 bounds: x = %u , y = %u , w = %u , h = %u\n", x_bounds[0], x_bounds[1], x_bounds[2], x_bounds[3]);
-						}
+					if (init_x11() != 0) {
+						syslog(LOG_ERR, "X11 init failed.\n");
+						UNSET_FLAG(id_ptr, FLG_USEX11);
+					}
+					if (use_xdiff && check_x11_bounds(x_bounds) != 0) {
+						syslog(LOG_ERR, "X11 diff using default bounds.\n");
 					}
 				}
-				else if (use_x) {
-					memset(&id_ptr->xauthority[0], '\0', IPC_PATHMAX);
-					memset(&id_ptr->xdisplay[0], '\0', IPC_XDISPMAX);
-					unsetenv("DISPLAY");
-					unsetenv("XAUTHORITY");
-					unsetenv("SLEEPD_XUSER");
-					memset(&x_bounds[0], '\0', sizeof(x_bounds));
+
+				if (use_xdiff && memcmp(&x_bounds[0], &id_ptr->xdiff_bounds[0], sizeof(x_bounds)) != 0) {
+					memcpy(&x_bounds[0], &id_ptr->xdiff_bounds[0], sizeof(x_bounds));
+					if (check_x11_bounds(x_bounds) != 0) {
+						syslog(LOG_ERR, "X11 bounds check failed, using default.\n");
+						memcpy(&id_ptr->xdiff_bounds[0], &x_bounds[0], sizeof(x_bounds));
+					}
+					if (x_oldimg) {
+						XDestroyImage(x_oldimg);
+						x_oldimg = NULL;
+					}
+					if (debug) {
+						printf("sleepd: X11 bounds: x = %u , y = %u , w = %u , h = %u\n", x_bounds[0], x_bounds[1], x_bounds[2], x_bounds[3]);
+					}
 				}
-				use_x = GET_FLAG(id_ptr, FLG_USEX11) != 0;
-#endif
 			}
-			ipc_unlock();
+			else if (use_x) {
+				memset(&id_ptr->xauthority[0], '\0', IPC_PATHMAX);
+				memset(&id_ptr->xdisplay[0], '\0', IPC_XDISPMAX);
+				unsetenv("DISPLAY");
+				unsetenv("XAUTHORITY");
+				unsetenv("SLEEPD_XUSER");
+				memset(&x_bounds[0], '\0', sizeof(x_bounds));
+			}
+			use_x = GET_FLAG(id_ptr, FLG_USEX11) != 0;
+#endif
 		}
+		ipc_unlock();
+	}
+}
 
-		activity=0;
-		if (use_events) {
-			pthread_mutex_lock(&condition_mutex);
-			pthread_cond_signal(&condition_cond);
-			pthread_mutex_unlock(&condition_mutex);
-		}
+/* sleepctl signals us after it changed something. */
+void ipc_notify_cb (int fd, unsigned int events, void *arg) {
+	struct signalfd_siginfo si;
+
+	while (read(fd, &si, sizeof(si)) == sizeof(si))
+		;
+	if (debug)
+		printf("sleepd: ipc notification\n");
+	sync_ipc();
+	wake_tick();
+}
+
+/* Shared between the sampling tasks and the tick that evaluates them. All
+ * activity timestamps are CLOCK_MONOTONIC in ms. */
+static int total_unused = 0;
+static int sleep_battery = 0;
+static int prev_ac_line_status = -1;
+static apm_info ai;
+/* All batteries together (ACPI only), the power drawn from them smoothed
+ * with a half-life of BATTERY_RATE_HALFLIFE, and the minutes left at that
+ * rate. */
+static struct acpi_batt_total batt = { -1, -1, -1 };
+static double batt_rate = -1;		/* uW, -1 if not known */
+static long long batt_rate_time = 0;
+static int batt_minutes = -1;
+/* After a low battery hibernation, the battery has to be charged again by
+ * batt_hysteresis percent before it counts as low again. */
+static unsigned char low_batt_armed = 1;
+static int low_batt_level = -1;
+static long long reset_active = 0;	/* start, wake up after sleeping */
+static long long power_active = 0;	/* AC plug/unplug */
+#ifdef X11
+static int x_unused = 0;
+static int xdiff_unused = 0;
+static long long xdiff_active = 0;
+#endif
+static struct sched_task *tick = NULL;
+static unsigned char power_uevents = 1;
+
+static const struct {
+	const char *name;
+	long long *active;
+} events[] = {
+	{ "start/resume", &reset_active },
+	{ "AC status change", &power_active },
+};
+
+/* Something changed that affects the sleep decision, evaluate right away. */
+void wake_tick (void) {
+	if (tick)
+		sched_set_due(tick, sched_now());
+}
+
+/* Everything counts as active now, e.g. after waking up. */
+void reset_activity (long long now) {
+	reset_active = now;
+	activity_reset(now);
+#ifdef X11
+	x_unused = 0;
+	xdiff_unused = 0;
+	xdiff_active = now;
+#endif
+}
+
+/* Update the smoothed discharge rate and the minutes left from batt. The
+ * power the batteries report is used if they do, the energy they lost
+ * since it last changed otherwise. */
+static void battery_rate (long long now) {
+	static long long prev_energy = -1, prev_time = 0;
+	double sample = -1;
+
+	if (ai.ac_line_status == 1 || batt.energy < 0) {
+		/* not discharging, start over when it is again */
+		batt_rate = -1;
+		batt_minutes = -1;
+		prev_energy = -1;
+		return;
+	}
+	if (batt.power > 0) {
+		sample = batt.power;
+	}
+	else if (prev_energy >= 0 && batt.energy < prev_energy && now > prev_time) {
+		/* uWh per ms to uW */
+		sample = (prev_energy - batt.energy) * 3600000.0 / (now - prev_time);
+	}
+	if (prev_energy != batt.energy) {
+		prev_energy = batt.energy;
+		prev_time = now;
+	}
+	if (sample > 0) {
+		if (batt_rate < 0)
+			batt_rate = sample;
+		else
+			batt_rate += (1 - exp2(-(now - batt_rate_time) / (BATTERY_RATE_HALFLIFE * 1000.0))) * (sample - batt_rate);
+		batt_rate_time = now;
+	}
+	batt_minutes = batt_rate > 0 ? (int)(batt.energy / batt_rate * 60) : -1;
+}
 
-		if (use_acpi) {
-			acpi_read(1, &ai);
+/* Why the battery counts as low, for the log. */
+static const char *battery_low_reason (void) {
+	static char reason[64];
+
+	if (min_batt != -1 && ai.battery_percentage != -1 && ai.battery_percentage < min_batt)
+		snprintf(reason, sizeof(reason), "battery level %d%% is below %d%%", ai.battery_percentage, min_batt);
+	else
+		snprintf(reason, sizeof(reason), "battery runs out in %d minutes", batt_minutes);
+	return reason;
+}
+
+/* Hibernating because of the battery does not happen again right after
+ * resuming, only once it was charged. If the level is not known now, the
+ * first known one counts. */
+static void battery_disarm (void) {
+	low_batt_armed = 0;
+	low_batt_level = ai.battery_percentage;
+}
+
+/* Act on a new battery and ac state in ai. */
+static void battery_check (long long now) {
+	int old_sleep_battery = sleep_battery;
+
+	battery_rate(now);
+	if (debug && ai.battery_status != BATTERY_STATUS_ABSENT)
+		printf("sleepd: battery level: %d%%, remaining time: %c%d:%02d\n",
+			ai.battery_percentage,
+			(ai.battery_time < 0) ? '-' : ' ',
+			abs(ai.battery_time) / 3600, (abs(ai.battery_time) / 60) % 60);
+	if (debug && batt_minutes >= 0)
+		printf("sleepd: battery: %.1fW drawn, %d minutes left\n", batt_rate / 1000000, batt_minutes);
+
+	if (! low_batt_armed && ai.battery_percentage != -1) {
+		if (low_batt_level == -1) {
+			/* not known when hibernating, count from here */
+			low_batt_level = ai.battery_percentage;
 		}
-#ifdef HAL
-		else if (use_simplehal) {
-			simplehal_read(1, &ai);
+		else if (ai.battery_percentage >= low_batt_level + batt_hysteresis) {
+			if (debug)
+				printf("sleepd: battery charged to %d%%, low battery hibernation re-armed\n", ai.battery_percentage);
+			low_batt_armed = 1;
 		}
+	}
+
+	if (low_batt_armed && ai.ac_line_status != 1 &&
+	    ai.battery_status != BATTERY_STATUS_ABSENT &&
+	    ((min_batt != -1 && ai.battery_percentage != -1 && ai.battery_percentage < min_batt) ||
+	     (min_batt_time > 0 && batt_minutes >= 0 && batt_minutes < min_batt_time))) {
+		sleep_battery = 1;
+	}
+
+	if (sleep_battery && ! require_unused_and_battery) {
+		syslog(LOG_NOTICE, "%s; forcing hibernation", battery_low_reason());
+		battery_disarm();
+		if (safe_exec(hibernate_command, total_unused) != 0)
+			syslog(LOG_ERR, "%s failed", hibernate_command);
+		/* This counts as activity; to prevent double sleeps. */
+		if (debug)
+			printf("sleepd: activity: just woke up\n");
+		reset_activity(sched_now());
+		sleep_battery = 0;
+		wake_tick();
+	}
+	else if (sleep_battery != old_sleep_battery) {
+		/* -A: may be idle long enough already */
+		wake_tick();
+	}
+
+	if ((ai.ac_line_status != prev_ac_line_status) && (prev_ac_line_status != -1)) {
+		/* AC plug/unplug counts as activity. It also selects another
+		 * idle limit. */
+		if (debug)
+			printf("sleepd: activity: AC status change\n");
+		power_active = now;
+		wake_tick();
+	}
+	prev_ac_line_status = ai.ac_line_status;
+}
+
+int battery_task (struct sched_task *t, long long now) {
+	if (use_acpi) {
+		acpi_read_batteries(0, &ai, &batt);
+	}
+#ifdef HAL
+	else if (use_simplehal) {
+		simplehal_read(1, &ai);
+	}
 #endif
 #ifdef UPOWER
-		else if (use_upower) {
-			upower_read(1, &ai);
-		}
+	else if (use_upower) {
+		upower_read(1, &ai);
+	}
 #endif
 #if defined(USE_APM)
-		else {
-			apm_read(&ai);
-		}
+	else {
+		apm_read(&ai);
+	}
 #else
-		else {
-			syslog(LOG_CRIT, "APM support is disabled, no other methods available. Abort.");
-			abort();
-		}
-#endif
-#ifdef X11
-		if (use_x) {
-			x_unused = check_x11();
-			if (x_unused == -1) {
-				syslog(LOG_ERR, "X11 idle check failed, disable.\n");
-				use_x = 0;
-			}
-			if (x_unused == 0)
-				activity=1;
-		}
-		if (use_xdiff) {
-			ssize_t ret = calc_x11_screendiff(&x_oldimg, x_bounds, use_xdiff+1);
-			if (ret >= 0) {
-				if (ret <= use_xdiff) {
-					xdiff_unused += sleep_time;
-				} else xdiff_unused = 0;
-				if (debug)
-					printf("sleepd: x11 diff returned %lu\n", ret);
-			}
- 		}
+	else {
+		syslog(LOG_CRIT, "APM support is disabled, no other methods available. Abort.");
+		abort();
+	}
 #endif
 
-		if (debug && ai.battery_status != BATTERY_STATUS_ABSENT)
-			printf("sleepd: battery level: %d%%, remaining time: %c%d:%02d\n",
-				ai.battery_percentage,
-				(ai.battery_time < 0) ? '-' : ' ',
-				abs(ai.battery_time) / 3600, (abs(ai.battery_time) / 60) % 60);
-
-		if (min_batt != -1 && ai.ac_line_status != 1 && 
-		    ai.battery_percentage != -1 &&
-		    ai.battery_percentage < min_batt &&
-		    ai.battery_status != BATTERY_STATUS_ABSENT) {
-			sleep_battery = 1;
-		}
+	battery_check(now);
+	return 0;
+}
 
-		if (sleep_battery && ! require_unused_and_battery) {
-			syslog(LOG_NOTICE, "battery level %d%% is below %d%%; forcing hibernation", ai.battery_percentage, min_batt);
-			if (safe_exec(hibernate_command, total_unused) != 0)
-				syslog(LOG_ERR, "%s failed", hibernate_command);
-			/* This counts as activity; to prevent double sleeps. */
-			if (debug)
-				printf("sleepd: activity: just woke up\n");
-			activity = 1;
-			oldtime = 0;
-			sleep_battery = 0;
-		}
+/* The batteries and ac adapters report their changes as uevents, which carry
+ * the new values. */
+static void power_uevent (const char *action, const char *subsystem,
+		const char *msg, size_t len, void *arg) {
+	const char *name;
+
+	if (strcmp(subsystem, "power_supply") != 0)
+		return;
+	name = uevent_get(msg, len, "POWER_SUPPLY_NAME");
+	if (!name && (name = uevent_get(msg, len, "DEVPATH")))
+		name = strrchr(name, '/') + 1;
+	if (!name || !acpi_supply_event(action, name, msg, len))
+		return;
+	if (debug)
+		printf("sleepd: power supply %s: %s\n", name, action);
+	acpi_read_batteries(1, &ai, &batt);
+	battery_check(sched_now());
+}
 
-		if ((ai.ac_line_status != prev_ac_line_status) && (prev_ac_line_status != -1)) {
-			/* AC plug/unplug counts as activity. */
-			if (debug)
-				printf("sleepd: activity: AC status change\n");
-			activity = 1;
+#ifdef X11
+/* X11 and its screen diff have their own idle limits, see tick_task. X11
+ * input is activity like any other though, it counts towards -u and -U. */
+static int x11_sample (struct activity_source *src, long long now, int baseline) {
+	if (use_x) {
+		x_unused = check_x11();
+		if (x_unused == -1) {
+			syslog(LOG_ERR, "X11 idle check failed, disable.\n");
+			use_x = 0;
+			x_unused = 0;
 		}
-		prev_ac_line_status = ai.ac_line_status;
-
-		/* Rest is only needed if sleeping on inactivity. */
-		if (! max_unused && ! ac_max_unused) {
-			sleep(sleep_time);
-			continue;
+		else if (now - x_unused * 1000LL > src->last_active) {
+			src->last_active = now - x_unused * 1000LL;
 		}
+	}
+	return 0;
+}
 
-		if (autoprobe || have_irqs) {
-			activity = check_irqs(activity, autoprobe);
-		}
+static int xdiff_init (struct activity_source *src) {
+	return use_xdiff != 0;
+}
 
-		if (use_net) {
-			activity = check_net(activity);
-		}
+static int xdiff_sample (struct activity_source *src, long long now, int baseline) {
+	ssize_t ret = calc_x11_screendiff(&x_oldimg, x_bounds, use_xdiff+1);
+	if (ret >= 0) {
+		if (ret > use_xdiff)
+			xdiff_active = now;
+		if (debug)
+			printf("sleepd: x11 diff returned %lu\n", ret);
+	}
+	return 0;
+}
 
-		if ((max_loadavg != 0) &&
-		    (getloadavg(loadavg, 1) == 1) &&
-		    (loadavg[0] >= max_loadavg)) {
-			/* If the load average is too high */
-			if (debug)
-				printf("sleepd: activity: load average %f\n", loadavg[0]);
-			activity = 1;
-		}
+static struct activity_source x11_source = {
+	.name = "x11",
+	.flags = ACT_DEFERRED,
+	.sample = x11_sample,
+};
+
+static struct activity_source xdiff_source = {
+	.name = "xdiff",
+	.flags = ACT_POLLED | ACT_OWNLIMIT,
+	.init = xdiff_init,
+	.sample = xdiff_sample,
+};
+#endif
 
-		if (use_utmp == 1) {
-			total_unused = check_utmp(total_unused);
-		}
+static long long min_deadline (long long a, long long b) {
+	return (a < b) ? a : b;
+}
 
-		if (ipc_lock() == 0) {
-			struct ipc_data *id_ptr = NULL;
-			ipc_getshmptr(&id_ptr);
-			id_ptr->total_unused = total_unused;
-#ifdef X11
-			id_ptr->xmax_unused = x_unused;
-			id_ptr->xdiff_unused = xdiff_unused;
-#endif
-			ipc_unlock();
+/* Evaluate the last activity of all sources and decide whether to put the
+ * system to sleep. Instead of running periodically, the tick re-arms itself
+ * on the nearest idle limit; sources that move that limit do not have to
+ * wake it up. utmp and X11 report the time of their last activity
+ * themselves, so they are sampled here, right when it matters. */
+int tick_task (struct sched_task *t, long long now) {
+	long long last = 0, deadline = SCHED_NEVER;
+	const char *last_name = NULL;
+	unsigned char sleep_now = 0, slept = 0;
+	int limit;
+	size_t i;
+
+	/* In case the resume notification got lost. */
+	resume_check();
+	/* sleepctl may not be permitted to signal us. */
+	sync_ipc();
+
+	activity_sample_deferred(now);
+	last = activity_last(&last_name);
+	for (i = 0; i < ARRAY_SIZE(events); i++) {
+		if (*events[i].active > last) {
+			last = *events[i].active;
+			last_name = events[i].name;
 		}
+	}
+	total_unused = (int)((now - last) / 1000);
+	if (debug) {
+		printf("sleepd: idle for %ds, last activity: %s\n", total_unused, last_name);
+		activity_print_costs();
+	}
 
-		sleep(sleep_time);
+	limit = (ai.ac_line_status == 1) ? ac_max_unused : max_unused;
 
 #ifdef X11
-		if (use_x && ! no_sleep) {
-			if (xmax_unused > 0) {
-				sleep_now = (x_unused >= xmax_unused);
-			} else if (max_unused > 0) {
-				sleep_now = (x_unused >= max_unused);
-			}
+	if (use_xdiff && eventData.last_activity > xdiff_active)
+		xdiff_active = eventData.last_activity;
+	xdiff_unused = (int)((now - xdiff_active) / 1000);
+	if (use_x && ! no_sleep) {
+		int xlimit = (xmax_unused > 0) ? xmax_unused : max_unused;
+		if (xlimit > 0) {
+			sleep_now = (x_unused >= xlimit);
 			if (sleep_now) {
 				syslog(LOG_NOTICE, "x11 inactive");
-				activity = 0;
 				total_unused = x_unused;
 			}
-			if (use_xdiff && ! sleep_now) {
-				sleep_now = (xdiff_unused > xdiff_max_unused);
-				if (sleep_now) {
-					syslog(LOG_NOTICE, "x11 diff inactive");
-					activity = 0;
-					total_unused = xdiff_unused;
-				}
+			else {
+				deadline = min_deadline(deadline, now + (xlimit - x_unused) * 1000LL);
 			}
 		}
-#endif
-
-		if (use_events) {
-			pthread_mutex_lock(&activity_mutex);
-			int i;
-			for (i=0; eventData.channels[i] != -1; i++) {
-				if (eventData.emactivity[i] == 1) {
-					if (debug)
-						printf("sleepd: activity: keyboard/mouse events %s\n", eventData.events[i]);
-					activity = 1;
-#ifdef X11
-					xdiff_unused = 0;
-#endif
-				}
+		if (use_xdiff && ! sleep_now) {
+			sleep_now = (xdiff_unused >= xdiff_max_unused);
+			if (sleep_now) {
+				syslog(LOG_NOTICE, "x11 diff inactive");
+				total_unused = xdiff_unused;
+			}
+			else {
+				deadline = min_deadline(deadline, xdiff_active + xdiff_max_unused * 1000LL);
 			}
-			pthread_mutex_unlock(&activity_mutex);
 		}
+	}
+#endif
 
-		if (activity) {
-			total_unused = 0;
+	if (! sleep_now && limit > 0) {
+		sleep_now = (total_unused >= limit);
+		if (! sleep_now)
+			deadline = min_deadline(deadline, last + limit * 1000LL);
+	}
+	activity_park(limit > 0, now);
+
+	if (sleep_now && ! no_sleep && ! require_unused_and_battery) {
+		char *command = sleep_command;
+		if (thermal_hot()) {
+			/* --thermal hibernate=n */
+			syslog(LOG_NOTICE, "system inactive for %ds and hot; forcing hibernation", total_unused);
+			command = hibernate_command;
 		}
 		else {
-			total_unused += sleep_time;
-			if (! sleep_now && ai.ac_line_status == 1) {
-				/* On wall power. */
-				if (ac_max_unused > 0) {
-					sleep_now = (total_unused >= ac_max_unused);
-				}
-			}
-			else if (! sleep_now && max_unused > 0) {
-				sleep_now = (total_unused >= max_unused);
-			}
+			syslog(LOG_NOTICE, "system inactive for %ds; forcing sleep", total_unused);
+		}
+		if (safe_exec(command, total_unused) != 0) {
+			syslog(LOG_ERR, "%s failed", command);
+		}
+		total_unused = 0;
+		reset_activity(sched_now());
+		slept = 1;
+	}
+	else if (sleep_now && ! no_sleep && sleep_battery) {
+		syslog(LOG_NOTICE, "system inactive for %ds and %s; forcing hibernaton",
+		       total_unused, battery_low_reason());
+		battery_disarm();
+		if (safe_exec(hibernate_command, total_unused) != 0) {
+			syslog(LOG_ERR, "%s failed", hibernate_command);
+		}
+		total_unused = 0;
+		reset_activity(sched_now());
+		sleep_battery = 0;
+		slept = 1;
+	}
 
-			if (sleep_now && ! no_sleep && ! require_unused_and_battery) {
-				syslog(LOG_NOTICE, "system inactive for %ds; forcing sleep", total_unused);
-				if (safe_exec(sleep_command, total_unused) != 0) {
-					syslog(LOG_ERR, "%s failed", sleep_command);
-				}
-				total_unused = 0;
+	if (slept) {
+		/* just woke up, start over */
+		t->due = sched_now();
+	}
+	else {
+		/* Past the limit but not sleeping (sleepctl off, -A) means
+		 * there is no deadline. The battery wakes us up, but sleepctl
+		 * may not be able to, so look at the shm every sleep_time. */
+		if (deadline == SCHED_NEVER)
+			deadline = now + t->period;
+		t->due = deadline;
+		if (debug && deadline != SCHED_NEVER)
+			printf("sleepd: next check in %llds\n", (deadline - now + 999) / 1000);
+	}
+
+	if (ipc_lock() == 0) {
+		struct ipc_data *id_ptr = NULL;
+		ipc_getshmptr(&id_ptr);
+		id_ptr->total_unused = total_unused;
 #ifdef X11
-				x_unused = 0;
-				xdiff_unused = 0;
+		id_ptr->xmax_unused = x_unused;
+		id_ptr->xdiff_unused = xdiff_unused;
 #endif
-				oldtime = 0;
-				sleep_now = 0;
-			}
-			else if (sleep_now && ! no_sleep && sleep_battery) {
-				syslog(LOG_NOTICE, "system inactive for %ds and battery level %d%% is below %d%%; forcing hibernaton", 
-				       total_unused, ai.battery_percentage, min_batt);
-				if (safe_exec(hibernate_command, total_unused) != 0) {
-					syslog(LOG_ERR, "%s failed", hibernate_command);
-				}
-				total_unused = 0;
+		ipc_unlock();
+	}
+	return 0;
+}
+
+/* The system was suspended, by us or someone else. */
+void resumed (long long slept_ms) {
+	no_sleep = 0; /* reset, since they must have put it to sleep */
+	if (ipc_lock() == 0) {
+		/* or the tick reads "off" back from the shm */
+		struct ipc_data *id_ptr = NULL;
+		ipc_getshmptr(&id_ptr);
+		SET_FLAG(id_ptr, FLG_ENABLED);
+		ipc_unlock();
+	}
+	syslog(LOG_NOTICE,
+			"%lld sec sleep; resetting timer",
+			(slept_ms + 500) / 1000);
+	reset_activity(sched_now());
+	wake_tick();
+}
+
+/* The activity sources are scheduled in between, the tick has to come
+ * last. Periods of 0 and negative jitters are filled in with the defaults
+ * by main_loop. */
+static struct sched_task battery = { .name = "battery", .run = battery_task, .jitter = -1 };
+static struct sched_task tick_sched = { .name = "tick", .run = tick_task, .jitter = -1 };
+
+/* Lookup for --period, the tick is not periodic. */
+struct sched_task *find_task (const char *name, size_t len) {
+	struct activity_source *src;
+
+	if (strlen(battery.name) == len && strncmp(battery.name, name, len) == 0)
+		return &battery;
+	src = activity_find(name, len);
+	if (src && (src->flags & ACT_POLLED))
+		return &src->task;
+	return NULL;
+}
+
+void main_loop (void) {
+	sigset_t mask;
+	int sigfd;
+	long long now;
+
+	unsetenv("SLEEPD_XUSER");
+	unsetenv("DISPLAY");
+	unsetenv("XAUTHORITY");
+
+	memset(&ai, '\0', sizeof(ai));
 #ifdef X11
-				x_unused = 0;
+	memset(&x_bounds[0], '\0', sizeof(x_bounds));
 #endif
-				oldtime = 0;
-				sleep_now = 0;
-				sleep_battery = 0;
-			}
-		}
 
-		/*
-		 * Keep track of how long it's been since we were last
-		 * here. If it was much longer than sleep_time, the system
-		 * was probably suspended, or this program was, (or the 
-		 * kernel is thrashing :-), so clear idle counter.
-		 */
-		nowtime = time(NULL);
-		/* The 1 is a necessary fudge factor. */
-		if (oldtime && (nowtime - sleep_time) > (oldtime + 1)) {
-			no_sleep = 0; /* reset, since they must have put it to sleep */
-			syslog(LOG_NOTICE,
-					"%i sec sleep; resetting timer",
-					(int)(nowtime - oldtime));
-			total_unused = 0;
+	if (reactor_init() != 0) {
+		perror("reactor_init");
+		exit(1);
+	}
+
+	sigemptyset(&mask);
+	sigaddset(&mask, IPC_NOTIFY_SIG);
+	sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (sigfd < 0 || reactor_add(sigfd, EPOLLIN, ipc_notify_cb, NULL) != 0) {
+		syslog(LOG_ERR, "signalfd: %s; sleepctl changes are picked up on the next check", strerror(errno));
+	}
+
+	if (resume_init(resumed) != 0) {
+		syslog(LOG_WARNING, "no resume notifications: %s; checking on each tick", strerror(errno));
+	}
+
+	sync_ipc();
+
+	/* Sample everything once right away, the tick evaluates it. */
+	now = sched_now();
+	reset_activity(now);
+	if (use_acpi && uevent_listen(power_uevent, NULL) != 0) {
+		syslog(LOG_WARNING, "no power supply uevents: %s; polling the battery", strerror(errno));
+		power_uevents = 0;
+	}
+	if (battery.period == 0) {
+		/* The battery changes on a scale of minutes. With uevents,
+		 * reading it is only a fallback. */
+		battery.period = (sleep_time < BATTERY_PERIOD ? BATTERY_PERIOD : sleep_time) * 1000;
+		if (use_acpi && power_uevents && battery.period < BATTERY_FALLBACK_PERIOD * 1000)
+			battery.period = BATTERY_FALLBACK_PERIOD * 1000;
+	}
+	if (battery.jitter < 0)
+		battery.jitter = battery.period / 10;
+	if (debug)
+		printf("sleepd: %s: period %lldms, jitter %lldms\n", battery.name, battery.period, battery.jitter);
+	/* Re-armed on the nearest deadline by itself. */
+	tick_sched.period = sleep_time * 1000;
+	tick_sched.jitter = 0;
+	if (sched_add(&battery, now) != 0 ||
+	    activity_init(max_unused || ac_max_unused, sleep_time * 1000LL) < 0 ||
+	    sched_add(&tick_sched, now) != 0) {
+		fprintf(stderr, "sleepd: unable to schedule the checks\n");
+		exit(1);
+	}
+	tick = &tick_sched;
+
+	while (1) {
+		if (sched_run() < 0) {
+			perror("sched_run");
+			exit(1);
 		}
-		oldtime = nowtime;
 	}
 }
 
@@ -978,28 +1158,45 @@ void cleanup (int signum) {
 		unlink(PID_FILE);
 	}
 	ipc_close_master();
-	if (use_events && pthread_cancel(emthread) == 0)
-		pthread_join(emthread, NULL);
+	if (use_acpi)
+		uevent_unlisten(power_uevent, NULL);
+	activity_teardown();
+	resume_close();
+	reactor_close();
 	exit(0);
 }
 
 int main (int argc, char **argv) {
 	FILE *f;
 
-	memset(&irqs[0], '\0', MAX_IRQS*sizeof(int));
-	size_t i;
-	for (i = 0; i < MAX_NET; ++i) {
-		min_tx[i] = TXRATE;
-		min_rx[i] = RXRATE;
-		net_samples[i] = 1;
-		memset(&netdevtx[i][0], '\0', ARRAY_SIZE(netdevtx[i]));
-		memset(&netdevrx[i][0], '\0', ARRAY_SIZE(netdevrx[i]));
-	}
-	memset(&net_samples_rx[0], '\0', MAX_NET*MAX_SAMPLES*sizeof(int));
-	memset(&net_samples_tx[0], '\0', MAX_NET*MAX_SAMPLES*sizeof(int));
+	/* In order of a cheap sample first, before --period is parsed. psi
+	 * comes before the load average it replaces. */
+	activity_register(&psi_source);
+	activity_register(&load_source);
+	activity_register(&thermal_source);
+	activity_register(&audio_source);
+	activity_register(&irq_source);
+	activity_register(&net_source);
+	activity_register(&sock_source);
+	activity_register(&cgroup_source);
+	activity_register(&disk_source);
+	activity_register(&event_source);
+	activity_register(&utmp_source);
+	activity_register(&proc_source);
+#ifdef X11
+	activity_register(&x11_source);
+	activity_register(&xdiff_source);
+#endif
 
 	parse_command_line(argc, argv);
 
+	/* sleepctl notifications are read from a signalfd in main_loop. Block
+	 * the signal before our pid is published, so it can't kill us. */
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, IPC_NOTIFY_SIG);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+
 	/* Log to the console if not daemonizing. */
 	openlog("sleepd", LOG_PID | (daemonize ? 0 : LOG_PERROR), LOG_DAEMON);
 
@@ -1009,7 +1206,7 @@ int main (int argc, char **argv) {
 		signal(SIGINT, cleanup);
 
 	if (! use_events) {
-		if (! have_irqs && ! autoprobe) {
+		if (! irq_configured()) {
 			fprintf(stderr, "No irqs specified.\n");
 			exit(1);
 		}
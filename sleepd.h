@@ -1,16 +1,17 @@
 #define PKG_NAME "sleepd"
 #define PKG_MAIL "matzeton@googlemail.com"
 #define PKG_VERSION_MAJOR 2
-#define PKG_VERSION_MINOR 12
+#define PKG_VERSION_MINOR 13
 
-#define MAX_IRQS 255
-#define MAX_NET 8
+#define MAX_IRQS 4096
 #define INTERRUPTS "/proc/interrupts"
 #define DEFAULT_SLEEP_TIME 10
+#define BATTERY_PERIOD 30
+#define BATTERY_FALLBACK_PERIOD 120
+#define BATTERY_RATE_HALFLIFE 300
+#define BATTERY_HYSTERESIS 5
 #define PID_FILE "/var/run/sleepd.pid"
-#define TXFILE "/sys/class/net/%s/statistics/tx_packets"
 #define TXRATE 15
-#define RXFILE "/sys/class/net/%s/statistics/rx_packets"
 #define RXRATE 25
 #define SHM_NAME "/sleepd-shm"
 #define IPC_MAXTRIES 10
@@ -0,0 +1,485 @@
+/*
+ * Connection activity source for sleepd
+ *
+ * Asks the kernel for the established TCP (and connected UDP) sockets
+ * through NETLINK_SOCK_DIAG, one dump per address family and protocol.
+ * The local ports of the rules are filtered in the kernel by a bytecode
+ * program, so only the sockets of interest are reported on hosts with many
+ * connections. A rule matches on local port, remote network and the bytes a
+ * TCP connection moves (acked and received) per minute, measured between two
+ * samples. A sample after a long pause (parked on AC power) only refreshes
+ * the counters, the bytes moved in the meantime are not recent.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/inet_diag.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/tcp.h>
+#include <linux/sock_diag.h>
+
+#include "sched.h"
+#include "activity.h"
+#include "sockdiag.h"
+
+#define SOCK_BUFSIZE 32768
+#define MAX_SOCK_RULES 16
+#define SOCK_MAXPORTS (MAX_SOCK_RULES)
+#define SOCK_WINDOW 60		/* seconds, bytes= is per minute */
+/* not in the uapi headers */
+#define SOCK_ESTABLISHED 1
+
+/* a --socket rule */
+struct sock_rule
+{
+	int proto;		/* IPPROTO_TCP or IPPROTO_UDP */
+	int port;		/* local port, 0 for any */
+	int family;		/* of net, 0 for any remote address */
+	unsigned char net[16];
+	int prefix;
+	unsigned long long bytes;	/* moved per SOCK_WINDOW, 0: any */
+};
+
+/* bytes moved by a connection, by socket cookie */
+struct sock_entry
+{
+	uint64_t cookie;	/* 0 if free */
+	uint64_t bytes;
+};
+
+struct sock_table
+{
+	struct sock_entry *e;
+	size_t size;		/* power of 2 */
+	size_t used;
+};
+
+static struct sock_rule rules[MAX_SOCK_RULES];
+static int nrules = 0;
+static int diag_fd = -1;
+static unsigned int diag_seq = 0;
+static char *sock_buf = NULL;
+/* the counters of the previous and of the current sample */
+static struct sock_table tables[2];
+static int cur = 0;
+static unsigned char have_prev = 0;
+static long long last_sample = 0;
+
+
+/* Parse "key=value,..." with the keys proto (tcp, udp), port, net
+ * (address/prefix) and bytes. Returns -1 on a bad rule. */
+int sock_add_rule (const char *spec) {
+	struct sock_rule *r;
+	char *copy, *tok, *save = NULL;
+	int ret = 0;
+
+	if (nrules >= MAX_SOCK_RULES)
+		return -1;
+	r = &rules[nrules];
+	memset(r, '\0', sizeof(*r));
+	r->proto = IPPROTO_TCP;
+
+	copy = strdup(spec);
+	if (!copy)
+		return -1;
+	for (tok = strtok_r(copy, ",", &save); tok && ret == 0; tok = strtok_r(NULL, ",", &save)) {
+		char *val = strchr(tok, '=');
+		char *end = NULL;
+
+		if (!val) {
+			ret = -1;
+			break;
+		}
+		*val++ = '\0';
+		if (strcmp(tok, "proto") == 0) {
+			if (strcmp(val, "tcp") == 0)
+				r->proto = IPPROTO_TCP;
+			else if (strcmp(val, "udp") == 0)
+				r->proto = IPPROTO_UDP;
+			else
+				ret = -1;
+		}
+		else if (strcmp(tok, "port") == 0) {
+			r->port = (int)strtol(val, &end, 10);
+			if (*end != '\0' || r->port <= 0 || r->port > 65535)
+				ret = -1;
+		}
+		else if (strcmp(tok, "net") == 0) {
+			char *slash = strchr(val, '/');
+			if (slash)
+				*slash++ = '\0';
+			if (inet_pton(AF_INET, val, r->net) == 1) {
+				r->family = AF_INET;
+				r->prefix = 32;
+			}
+			else if (inet_pton(AF_INET6, val, r->net) == 1) {
+				r->family = AF_INET6;
+				r->prefix = 128;
+			}
+			else {
+				ret = -1;
+			}
+			if (ret == 0 && slash) {
+				int prefix = (int)strtol(slash, &end, 10);
+				if (*end != '\0' || prefix < 0 || prefix > r->prefix)
+					ret = -1;
+				r->prefix = prefix;
+			}
+		}
+		else if (strcmp(tok, "bytes") == 0) {
+			r->bytes = strtoull(val, &end, 10);
+			if (*end == 'k' || *end == 'K')
+				r->bytes *= 1024, end++;
+			else if (*end == 'm' || *end == 'M')
+				r->bytes *= 1024 * 1024, end++;
+			if (*end != '\0')
+				ret = -1;
+		}
+		else {
+			ret = -1;
+		}
+	}
+	free(copy);
+	/* UDP sockets have no byte counters */
+	if (r->proto == IPPROTO_UDP && r->bytes)
+		ret = -1;
+	if (ret == 0)
+		nrules++;
+	return ret;
+}
+
+static int net_matches (const struct sock_rule *r, int family, const void *addr) {
+	const unsigned char *a = addr;
+	int bits = r->prefix;
+	int i;
+
+	if (r->family == 0)
+		return 1;
+	if (family != r->family) {
+		/* IPv4 mapped IPv6 address */
+		static const unsigned char mapped[12] = { 0,0,0,0,0,0,0,0,0,0,0xff,0xff };
+		if (r->family != AF_INET || family != AF_INET6 || memcmp(a, mapped, 12) != 0)
+			return 0;
+		a += 12;
+	}
+	for (i = 0; bits >= 8; i++, bits -= 8) {
+		if (a[i] != r->net[i])
+			return 0;
+	}
+	return bits == 0 || ((a[i] ^ r->net[i]) & (0xff << (8 - bits))) == 0;
+}
+
+static uint64_t hash_cookie (uint64_t cookie) {
+	cookie ^= cookie >> 33;
+	cookie *= 0xff51afd7ed558ccdULL;
+	cookie ^= cookie >> 33;
+	return cookie;
+}
+
+static struct sock_entry *table_slot (struct sock_table *t, uint64_t cookie) {
+	size_t i = hash_cookie(cookie) & (t->size - 1);
+
+	while (t->e[i].cookie != 0 && t->e[i].cookie != cookie)
+		i = (i + 1) & (t->size - 1);
+	return &t->e[i];
+}
+
+static struct sock_entry *table_find (struct sock_table *t, uint64_t cookie) {
+	struct sock_entry *e;
+
+	if (t->size == 0)
+		return NULL;
+	e = table_slot(t, cookie);
+	return e->cookie ? e : NULL;
+}
+
+/* Kept at most half full. Returns -1 if out of memory. */
+static int table_insert (struct sock_table *t, uint64_t cookie, uint64_t bytes) {
+	struct sock_entry *e;
+
+	if ((t->used + 1) * 2 > t->size) {
+		struct sock_table n;
+		size_t i;
+
+		n.size = t->size ? t->size * 2 : 256;
+		n.used = 0;
+		n.e = calloc(n.size, sizeof(*n.e));
+		if (!n.e)
+			return -1;
+		for (i = 0; i < t->size; i++) {
+			if (t->e[i].cookie)
+				*table_slot(&n, t->e[i].cookie) = t->e[i], n.used++;
+		}
+		free(t->e);
+		*t = n;
+	}
+	e = table_slot(t, cookie);
+	if (!e->cookie)
+		t->used++;
+	e->cookie = cookie;
+	e->bytes = bytes;
+	return 0;
+}
+
+static void table_clear (struct sock_table *t) {
+	if (t->e)
+		memset(t->e, '\0', t->size * sizeof(*t->e));
+	t->used = 0;
+}
+
+/* Kernel side filter: the local port is one of those in the rules. Per port
+ * a >= and a <= test (equality is only in newer kernels), followed by a jump
+ * to the end which accepts. A failed test skips to the next port, or past
+ * the end (rejecting) for the last one. This is the layout ss(8) uses, as
+ * the kernel only accepts jump targets reachable on the success path.
+ * Returns the length of the program, 0 if any port matches. */
+static int build_filter (int proto, struct inet_diag_bc_op *bc) {
+	int ports[SOCK_MAXPORTS];
+	int nports = 0, i, j, len;
+	struct inet_diag_bc_op *op = bc;
+
+	for (i = 0; i < nrules; i++) {
+		if (rules[i].proto != proto)
+			continue;
+		if (rules[i].port == 0)
+			return 0;
+		for (j = 0; j < nports && ports[j] != rules[i].port; j++)
+			;
+		if (j == nports)
+			ports[nports++] = rules[i].port;
+	}
+	if (nports == 0)
+		return 0;
+
+	len = (nports * 5 - 1) * sizeof(*bc);
+	for (i = 0; i < nports; i++) {
+		op[0].code = INET_DIAG_BC_S_GE;
+		op[0].yes = 2 * sizeof(*bc);
+		op[0].no = 5 * sizeof(*bc);
+		op[1].no = ports[i];
+		op[2].code = INET_DIAG_BC_S_LE;
+		op[2].yes = 2 * sizeof(*bc);
+		op[2].no = 3 * sizeof(*bc);
+		op[3].no = ports[i];
+		op += 4;
+		if (i < nports - 1) {
+			/* the bytes after the jump, then 4 more to land on the end */
+			op[0].code = INET_DIAG_BC_JMP;
+			op[0].yes = sizeof(*bc);
+			op[0].no = len - (int)((char *)op - (char *)bc);
+			op++;
+		}
+	}
+	return len;
+}
+
+/* One socket of a dump, interval (in ms) after the previous sample. Returns
+ * 1 if a rule says it is active. */
+static int check_socket (int proto, struct inet_diag_msg *msg, int len,
+		long long interval, unsigned char baseline) {
+	struct rtattr *rta;
+	struct tcp_info info;
+	int have_info = 0;
+	uint64_t cookie, bytes = 0;
+	struct sock_entry *prev;
+	int i, active = 0, wanted = 0;
+
+	memset(&info, '\0', sizeof(info));
+	for (rta = (struct rtattr *)(msg + 1); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		if (rta->rta_type == INET_DIAG_INFO) {
+			size_t n = RTA_PAYLOAD(rta);
+			/* older kernels have a shorter tcp_info */
+			if (n >= offsetof(struct tcp_info, tcpi_bytes_received) + sizeof(info.tcpi_bytes_received)) {
+				memcpy(&info, RTA_DATA(rta), n < sizeof(info) ? n : sizeof(info));
+				have_info = 1;
+			}
+		}
+	}
+	if (have_info)
+		bytes = info.tcpi_bytes_acked + info.tcpi_bytes_received;
+	memcpy(&cookie, msg->id.idiag_cookie, sizeof(cookie));
+	prev = table_find(&tables[!cur], cookie);
+
+	for (i = 0; i < nrules; i++) {
+		const struct sock_rule *r = &rules[i];
+		uint64_t moved;
+
+		if (r->proto != proto ||
+		    (r->port && r->port != ntohs(msg->id.idiag_sport)) ||
+		    !net_matches(r, msg->idiag_family, msg->id.idiag_dst))
+			continue;
+		wanted = 1;
+		if (r->bytes == 0) {
+			active = 1;
+		}
+		else if (have_info && have_prev && interval > 0) {
+			/* new connections moved everything since the last sample */
+			moved = prev ? bytes - prev->bytes : bytes;
+			if ((double)moved * (SOCK_WINDOW * 1000) / interval > r->bytes)
+				active = 1;
+		}
+		if (active) {
+			if (debug && ! baseline) {
+				char addr[INET6_ADDRSTRLEN];
+				inet_ntop(msg->idiag_family, msg->id.idiag_dst, addr, sizeof(addr));
+				printf("sleepd: activity: socket :%d <-> %s\n", ntohs(msg->id.idiag_sport), addr);
+			}
+			break;
+		}
+	}
+	if (wanted && have_info)
+		table_insert(&tables[cur], cookie, bytes);
+	return active;
+}
+
+/* Dump the sockets of one family and protocol. Returns 1 on activity, -1 on
+ * error. */
+static int dump_sockets (int family, int proto, long long interval, unsigned char baseline) {
+	struct {
+		struct nlmsghdr nh;
+		struct inet_diag_req_v2 req;
+		struct rtattr rta;
+		struct inet_diag_bc_op bc[SOCK_MAXPORTS * 5];
+	} req;
+	int bclen, activity = 0, done = 0;
+
+	memset(&req, '\0', sizeof(req));
+	bclen = build_filter(proto, req.bc);
+	req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(req.req));
+	req.nh.nlmsg_type = SOCK_DIAG_BY_FAMILY;
+	req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	req.nh.nlmsg_seq = ++diag_seq;
+	req.req.sdiag_family = family;
+	req.req.sdiag_protocol = proto;
+	/* connected UDP sockets are in TCP_ESTABLISHED too */
+	req.req.idiag_states = 1 << SOCK_ESTABLISHED;
+	if (proto == IPPROTO_TCP)
+		req.req.idiag_ext = 1 << (INET_DIAG_INFO - 1);
+	if (bclen > 0) {
+		req.rta.rta_type = INET_DIAG_REQ_BYTECODE;
+		req.rta.rta_len = RTA_LENGTH(bclen);
+		req.nh.nlmsg_len += req.rta.rta_len;
+	}
+	if (send(diag_fd, &req, req.nh.nlmsg_len, 0) < 0)
+		return -1;
+
+	while (!done) {
+		struct nlmsghdr *nh;
+		ssize_t len = recv(diag_fd, sock_buf, SOCK_BUFSIZE, 0);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len <= 0)
+			return -1;
+		for (nh = (struct nlmsghdr *)sock_buf; NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len)) {
+			if (nh->nlmsg_seq != diag_seq)
+				continue;
+			if (nh->nlmsg_type == NLMSG_DONE) {
+				done = 1;
+				break;
+			}
+			if (nh->nlmsg_type == NLMSG_ERROR) {
+				struct nlmsgerr *err = NLMSG_DATA(nh);
+				/* no UDP diag module loaded is not an error */
+				if (err->error != -ENOENT) {
+					errno = -err->error;
+					return -1;
+				}
+				done = 1;
+				break;
+			}
+			if (nh->nlmsg_len < NLMSG_LENGTH(sizeof(struct inet_diag_msg)))
+				continue;
+			if (check_socket(proto, NLMSG_DATA(nh),
+			    nh->nlmsg_len - NLMSG_LENGTH(sizeof(struct inet_diag_msg)),
+			    interval, baseline) > 0)
+				activity = 1;
+		}
+	}
+	return activity;
+}
+
+/* With baseline set only the byte counters are refreshed. */
+static int check_sockets (long long interval, unsigned char baseline) {
+	static const int families[] = { AF_INET, AF_INET6 };
+	static const int protos[] = { IPPROTO_TCP, IPPROTO_UDP };
+	int activity = 0;
+	size_t f, p;
+	int i, ret;
+
+	cur = !cur;
+	table_clear(&tables[cur]);
+	for (p = 0; p < sizeof(protos) / sizeof(protos[0]); p++) {
+		for (i = 0; i < nrules && rules[i].proto != protos[p]; i++)
+			;
+		if (i == nrules)
+			continue;
+		for (f = 0; f < sizeof(families) / sizeof(families[0]); f++) {
+			ret = dump_sockets(families[f], protos[p], interval, baseline);
+			if (ret < 0) {
+				perror("sleepd: sock_diag");
+				continue;
+			}
+			if (ret > 0)
+				activity = 1;
+		}
+	}
+	have_prev = 1;
+	return activity && ! baseline;
+}
+
+static int sock_init (struct activity_source *src) {
+	if (nrules == 0)
+		return 0;
+	sock_buf = malloc(SOCK_BUFSIZE);
+	diag_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_SOCK_DIAG);
+	if (!sock_buf || diag_fd < 0) {
+		perror("sleepd: sock_diag");
+		return -1;
+	}
+	return 1;
+}
+
+static int sock_sample (struct activity_source *src, long long now, int baseline) {
+	long long interval = now - last_sample;
+
+	/* The previous counters are stale after a pause, e.g. parked. */
+	if (interval > 2 * src->task.period)
+		have_prev = 0;
+	last_sample = now;
+	return check_sockets(interval, baseline);
+}
+
+static void sock_teardown (struct activity_source *src) {
+	if (diag_fd >= 0)
+		close(diag_fd);
+	diag_fd = -1;
+	free(sock_buf);
+	sock_buf = NULL;
+	free(tables[0].e);
+	free(tables[1].e);
+	memset(tables, '\0', sizeof(tables));
+}
+
+/* Dumps are filtered in the kernel, so this grows with the number of
+ * matching sockets only. */
+static double sock_cost (struct activity_source *src) {
+	return 30000;
+}
+
+struct activity_source sock_source = {
+	.name = "sock",
+	.flags = ACT_POLLED | ACT_IDLE | ACT_BASELINE,
+	.init = sock_init,
+	.sample = sock_sample,
+	.cost = sock_cost,
+	.teardown = sock_teardown,
+};
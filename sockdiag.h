@@ -0,0 +1,8 @@
+/*
+ * Connection activity source for sleepd
+ * (not Threadsafe!)
+ */
+
+extern struct activity_source sock_source;
+
+extern int sock_add_rule (const char *spec);
@@ -0,0 +1,203 @@
+/*
+ * Thermal zone activity source for sleepd
+ *
+ * The temperatures of the thermal zones (found by find_thermal in acpi.c)
+ * are read with pread from their temp files, which are kept open. A
+ * temperature which stays some degrees above its baseline for a while counts
+ * as activity: work which does not show up in the load average, e.g. a niced
+ * encoder. The baseline follows a falling temperature right away and a
+ * rising one only slowly (THERMAL_HALFLIFE), so a warmer room does not count.
+ * It stays put while a zone is above it by the rise, or long running work
+ * would become the baseline.
+ * The temperatures also decide whether to hibernate instead of suspending,
+ * see thermal_hot.
+ */
+
+#include <fnmatch.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "sched.h"
+#include "activity.h"
+#include "apm.h"
+#include "acpi.h"
+#include "thermal.h"
+
+#define THERMAL_PERIOD 30	/* seconds, temperatures change slowly */
+#define THERMAL_HALFLIFE 3600	/* seconds */
+#define THERMAL_SUSTAIN 60	/* seconds */
+
+struct zone
+{
+	unsigned char watched;
+	unsigned char have_baseline;
+	double baseline;	/* millidegrees */
+	long long last_sample;
+	long long above_since;	/* 0 if not above the baseline by min_rise */
+};
+
+static char *zone_pattern = NULL;	/* of the zone types, NULL for all */
+static int min_rise = 0;		/* millidegrees, 0 if not used */
+static long long sustain = THERMAL_SUSTAIN * 1000;
+static int hot_temp = 0;		/* millidegrees, 0 if not used */
+static struct zone zones[ACPI_MAXITEM];
+static int nzones = -1;			/* -1 until the zones are looked for */
+
+
+/* "[zone=type][,rise=n[:s]][,hibernate=n]" in degrees Celsius and seconds.
+ * May be given more than once. Returns -1 on a bad spec. */
+int thermal_add (const char *spec) {
+	const char *opt = spec;
+
+	while (*opt) {
+		size_t len = strcspn(opt, ",");
+		char *end = NULL;
+		double val;
+
+		if (strncmp(opt, "zone=", 5) == 0 && len > 5) {
+			free(zone_pattern);
+			zone_pattern = strndup(opt + 5, len - 5);
+			if (!zone_pattern)
+				return -1;
+			end = (char *)opt + len;
+		}
+		else if (strncmp(opt, "rise=", 5) == 0) {
+			val = strtod(opt + 5, &end);
+			if (val <= 0)
+				return -1;
+			min_rise = val * 1000;
+			if (*end == ':') {
+				val = strtod(end + 1, &end);
+				if (val < 0)
+					return -1;
+				sustain = val * 1000;
+			}
+		}
+		else if (strncmp(opt, "hibernate=", 10) == 0) {
+			val = strtod(opt + 10, &end);
+			if (val <= 0)
+				return -1;
+			hot_temp = val * 1000;
+		}
+		else {
+			return -1;
+		}
+		if (end != opt + len)
+			return -1;
+		opt += len;
+		if (*opt == ',')
+			opt++;
+	}
+	return 0;
+}
+
+/* Look for the zones, the type has to match the pattern. */
+static void find_zones (void) {
+	char buf[64];
+	int i, n = 0;
+
+	nzones = find_thermal();
+	for (i = 0; i < nzones; i++) {
+		struct zone *z = &zones[i];
+
+		memset(z, '\0', sizeof(*z));
+		if (!get_acpi_file(acpi_thermal_info[i], buf, sizeof(buf)))
+			continue;
+		buf[strcspn(buf, "\n")] = '\0';
+		if (zone_pattern && fnmatch(zone_pattern, buf, 0) != 0)
+			continue;
+		z->watched = 1;
+		n++;
+		if (debug)
+			printf("sleepd: thermal: watching %s (%s)\n", acpi_thermal_status[i], buf);
+	}
+	if (n == 0)
+		syslog(LOG_WARNING, "no thermal zones%s%s",
+			zone_pattern ? " of type " : "", zone_pattern ? zone_pattern : "");
+}
+
+/* Whether a watched zone is at or above the hibernate temperature. Read
+ * right when it matters, the tick asks before putting the system to sleep. */
+int thermal_hot (void) {
+	int i, temp;
+
+	if (!hot_temp)
+		return 0;
+	if (nzones < 0)
+		find_zones();
+	for (i = 0; i < nzones; i++) {
+		if (zones[i].watched && read_acpi_thermal(i, &temp) == 0 && temp >= hot_temp) {
+			if (debug)
+				printf("sleepd: thermal: %s at %.1fC\n", acpi_thermal_status[i], temp / 1000.0);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int thermal_init (struct activity_source *src) {
+	if (!min_rise)
+		return 0;
+	if (nzones < 0)
+		find_zones();
+	/* unless --period says otherwise */
+	if (src->task.period == 0)
+		src->task.period = THERMAL_PERIOD * 1000;
+	return 1;
+}
+
+/* With baseline set, only the baselines are followed. */
+static int thermal_sample (struct activity_source *src, long long now, int baseline) {
+	int activity = 0;
+	int i, temp;
+
+	for (i = 0; i < nzones; i++) {
+		struct zone *z = &zones[i];
+
+		if (!z->watched || read_acpi_thermal(i, &temp) != 0)
+			continue;
+		if (!z->have_baseline || temp < z->baseline) {
+			z->baseline = temp;
+			z->have_baseline = 1;
+		}
+		else if (!z->above_since) {
+			z->baseline += (1 - exp2(-(now - z->last_sample) / (THERMAL_HALFLIFE * 1000.0))) * (temp - z->baseline);
+		}
+		z->last_sample = now;
+		if (temp - z->baseline < min_rise) {
+			z->above_since = 0;
+			continue;
+		}
+		if (!z->above_since)
+			z->above_since = now;
+		if (!baseline && now - z->above_since >= sustain) {
+			if (debug)
+				printf("sleepd: activity: thermal %s %.1fC, %.1fC above baseline\n",
+					acpi_thermal_status[i], temp / 1000.0, (temp - z->baseline) / 1000.0);
+			activity = 1;
+		}
+	}
+	return activity;
+}
+
+static void thermal_teardown (struct activity_source *src) {
+	close_acpi_thermal();
+	nzones = -1;
+}
+
+/* One small pread per zone. */
+static double thermal_cost (struct activity_source *src) {
+	return 5000.0 * (nzones > 0 ? nzones : 1);
+}
+
+struct activity_source thermal_source = {
+	.name = "thermal",
+	.flags = ACT_POLLED | ACT_IDLE | ACT_BASELINE,
+	.init = thermal_init,
+	.sample = thermal_sample,
+	.cost = thermal_cost,
+	.teardown = thermal_teardown,
+};
@@ -0,0 +1,9 @@
+/*
+ * Thermal zone activity source for sleepd
+ * (not Threadsafe!)
+ */
+
+extern struct activity_source thermal_source;
+
+extern int thermal_add (const char *spec);
+extern int thermal_hot (void);
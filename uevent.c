@@ -0,0 +1,125 @@
+/*
+ * Kernel uevent listener for sleepd
+ *
+ * One NETLINK_KOBJECT_UEVENT socket on the reactor, shared by all sources
+ * that want to know about hotplug. It is opened with the first listener
+ * and closed with the last one.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+
+#include "reactor.h"
+#include "uevent.h"
+
+struct uevent_listener
+{
+	uevent_cb cb;
+	void *arg;
+};
+
+static int uevent_fd = -1;
+static struct uevent_listener listeners[UEVENT_MAXLISTENERS];
+static int nlisteners = 0;
+
+
+/* Value of key in an event, NULL if it has none. */
+const char *uevent_get (const char *msg, size_t len, const char *key) {
+	size_t klen = strlen(key);
+	const char *p = msg, *end = msg + len;
+
+	while (p < end) {
+		size_t n = strnlen(p, end - p);
+		if (n > klen && p[klen] == '=' && memcmp(p, key, klen) == 0)
+			return p + klen + 1;
+		p += n + 1;
+	}
+	return NULL;
+}
+
+static void uevent_callback (int fd, unsigned int events, void *arg) {
+	char buf[UEVENT_BUFSIZE];
+	struct sockaddr_nl sa;
+	socklen_t salen;
+	ssize_t len;
+
+	for (;;) {
+		const char *msg, *action, *subsystem;
+		size_t hlen;
+		int i;
+
+		salen = sizeof(sa);
+		len = recvfrom(fd, buf, sizeof(buf) - 1, 0, (struct sockaddr *)&sa, &salen);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len <= 0)
+			break;
+		/* only the kernel, not whoever else may send to the group */
+		if (salen != sizeof(sa) || sa.nl_pid != 0)
+			continue;
+		buf[len] = '\0';
+		/* "action@devpath" header, then the KEY=value pairs */
+		hlen = strlen(buf) + 1;
+		if (!strchr(buf, '@') || hlen >= (size_t)len)
+			continue;
+		msg = buf + hlen;
+		action = uevent_get(msg, len - hlen, "ACTION");
+		subsystem = uevent_get(msg, len - hlen, "SUBSYSTEM");
+		if (!action || !subsystem)
+			continue;
+		for (i = 0; i < nlisteners; i++)
+			listeners[i].cb(action, subsystem, msg, len - hlen, listeners[i].arg);
+	}
+}
+
+static int uevent_open (void) {
+	struct sockaddr_nl sa;
+
+	uevent_fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		NETLINK_KOBJECT_UEVENT);
+	if (uevent_fd < 0)
+		return -1;
+	memset(&sa, '\0', sizeof(sa));
+	sa.nl_family = AF_NETLINK;
+	sa.nl_groups = 1;	/* kernel events, not the ones relayed by udev */
+	if (bind(uevent_fd, (struct sockaddr *)&sa, sizeof(sa)) != 0 ||
+	    reactor_add(uevent_fd, EPOLLIN, uevent_callback, NULL) != 0) {
+		close(uevent_fd);
+		uevent_fd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+int uevent_listen (uevent_cb cb, void *arg) {
+	if (nlisteners >= UEVENT_MAXLISTENERS) {
+		errno = ENOSPC;
+		return -1;
+	}
+	if (uevent_fd < 0 && uevent_open() != 0)
+		return -1;
+	listeners[nlisteners].cb = cb;
+	listeners[nlisteners].arg = arg;
+	nlisteners++;
+	return 0;
+}
+
+void uevent_unlisten (uevent_cb cb, void *arg) {
+	int i;
+
+	for (i = 0; i < nlisteners; i++) {
+		if (listeners[i].cb == cb && listeners[i].arg == arg) {
+			listeners[i] = listeners[--nlisteners];
+			break;
+		}
+	}
+	if (nlisteners == 0 && uevent_fd >= 0) {
+		reactor_del(uevent_fd);
+		close(uevent_fd);
+		uevent_fd = -1;
+	}
+}
@@ -0,0 +1,17 @@
+/*
+ * Kernel uevent listener for sleepd
+ * (not Threadsafe!)
+ */
+
+#include <stddef.h>
+
+#define UEVENT_MAXLISTENERS 8
+#define UEVENT_BUFSIZE 8192
+
+/* msg holds the NUL separated KEY=value pairs of one event */
+typedef void (*uevent_cb)(const char *action, const char *subsystem,
+	const char *msg, size_t len, void *arg);
+
+extern int uevent_listen (uevent_cb cb, void *arg);
+extern void uevent_unlisten (uevent_cb cb, void *arg);
+extern const char *uevent_get (const char *msg, size_t len, const char *key);
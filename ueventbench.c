@@ -0,0 +1,170 @@
+/*
+ * Benchmark of the power supply uevent parser of sleepd
+ *
+ * Times parse_acpi_supply of acpi.c on uevent files recorded from real
+ * power supplies, against the six scan_acpi_num and scan_acpi_value calls
+ * acpi_read made on the same buffer before. parse_acpi_uevent is timed on
+ * the NUL separated form of a uevent message as well. The parsed values are
+ * checked against the recorded ones.
+ *
+ * make bench; ./ueventbench [rounds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "apm.h"
+#include "acpi.h"
+
+#define BENCH_ROUNDS 200000
+
+struct fixture
+{
+	const char *name;
+	const char *buf;
+	int capacity;
+	long long now;
+};
+
+/* As read from /sys/class/power_supply/<name>/uevent */
+static const struct fixture fixtures[] = {
+	{ "BAT0 (energy)",
+	  "POWER_SUPPLY_NAME=BAT0\n"
+	  "POWER_SUPPLY_TYPE=Battery\n"
+	  "POWER_SUPPLY_STATUS=Discharging\n"
+	  "POWER_SUPPLY_PRESENT=1\n"
+	  "POWER_SUPPLY_TECHNOLOGY=Li-poly\n"
+	  "POWER_SUPPLY_CYCLE_COUNT=211\n"
+	  "POWER_SUPPLY_VOLTAGE_MIN_DESIGN=15440000\n"
+	  "POWER_SUPPLY_VOLTAGE_NOW=15962000\n"
+	  "POWER_SUPPLY_POWER_NOW=7488000\n"
+	  "POWER_SUPPLY_ENERGY_FULL_DESIGN=57000000\n"
+	  "POWER_SUPPLY_ENERGY_FULL=51240000\n"
+	  "POWER_SUPPLY_ENERGY_NOW=36170000\n"
+	  "POWER_SUPPLY_CAPACITY=70\n"
+	  "POWER_SUPPLY_CAPACITY_LEVEL=Normal\n"
+	  "POWER_SUPPLY_MODEL_NAME=5B10W13930\n"
+	  "POWER_SUPPLY_MANUFACTURER=SMP\n"
+	  "POWER_SUPPLY_SERIAL_NUMBER= 1063\n",
+	  70, 36170000 },
+	{ "BAT1 (charge)",
+	  "POWER_SUPPLY_NAME=BAT1\n"
+	  "POWER_SUPPLY_TYPE=Battery\n"
+	  "POWER_SUPPLY_STATUS=Charging\n"
+	  "POWER_SUPPLY_PRESENT=1\n"
+	  "POWER_SUPPLY_TECHNOLOGY=Li-ion\n"
+	  "POWER_SUPPLY_CYCLE_COUNT=0\n"
+	  "POWER_SUPPLY_VOLTAGE_MIN_DESIGN=11100000\n"
+	  "POWER_SUPPLY_VOLTAGE_NOW=12361000\n"
+	  "POWER_SUPPLY_CURRENT_NOW=1270000\n"
+	  "POWER_SUPPLY_CHARGE_FULL_DESIGN=4400000\n"
+	  "POWER_SUPPLY_CHARGE_FULL=3941000\n"
+	  "POWER_SUPPLY_CHARGE_NOW=1852000\n"
+	  "POWER_SUPPLY_CAPACITY=46\n"
+	  "POWER_SUPPLY_CAPACITY_LEVEL=Normal\n"
+	  "POWER_SUPPLY_MODEL_NAME=DELL 7FJ9232\n"
+	  "POWER_SUPPLY_MANUFACTURER=SMP\n"
+	  "POWER_SUPPLY_SERIAL_NUMBER=2403\n",
+	  46, 1852000 },
+	{ "hidpp_battery_0",
+	  "POWER_SUPPLY_NAME=hidpp_battery_0\n"
+	  "POWER_SUPPLY_TYPE=Battery\n"
+	  "POWER_SUPPLY_ONLINE=1\n"
+	  "POWER_SUPPLY_STATUS=Discharging\n"
+	  "POWER_SUPPLY_SCOPE=Device\n"
+	  "POWER_SUPPLY_MODEL_NAME=MX Master 3\n"
+	  "POWER_SUPPLY_MANUFACTURER=Logitech\n"
+	  "POWER_SUPPLY_SERIAL_NUMBER=4082-a1-b7-29-6e\n"
+	  "POWER_SUPPLY_CAPACITY=55\n",
+	  55, -1 },
+	{ "AC",
+	  "POWER_SUPPLY_NAME=AC\n"
+	  "POWER_SUPPLY_TYPE=Mains\n"
+	  "POWER_SUPPLY_ONLINE=0\n",
+	  -1, -1 },
+};
+
+#define NFIXTURES (int)(sizeof(fixtures) / sizeof(fixtures[0]))
+
+/* What acpi_read did for each battery before the single pass parser. */
+static int scan_all (const char *buf) {
+	char *s;
+	int v = 0;
+
+	v += scan_acpi_num(buf, acpi_labels[label_present]);
+	v += scan_acpi_num(buf, acpi_labels[label_capacity]);
+	v += scan_acpi_num(buf, acpi_labels[label_last_full_capacity]);
+	v += scan_acpi_num(buf, acpi_labels[label_remaining_capacity]);
+	v += scan_acpi_num(buf, acpi_labels[label_present_rate]);
+	if ((s = scan_acpi_value(buf, acpi_labels[label_charging_state])) != NULL)
+		v += s[0];
+	return v;
+}
+
+static double elapsed (const struct timespec *a, const struct timespec *b) {
+	return (b->tv_sec - a->tv_sec) * 1e9 + (b->tv_nsec - a->tv_nsec);
+}
+
+int main (int argc, char **argv) {
+	int rounds = (argc > 1) ? atoi(argv[1]) : BENCH_ROUNDS;
+	struct acpi_supply_info info;
+	struct timespec a, b;
+	volatile int sink = 0;
+	int f, r, bad = 0;
+
+	if (rounds <= 0) {
+		fprintf(stderr, "usage: %s [rounds]\n", argv[0]);
+		return 1;
+	}
+	for (f = 0; f < NFIXTURES; f++) {
+		const struct fixture *fx = &fixtures[f];
+		size_t len = strlen(fx->buf);
+		char msg[1024];
+		double single, scans, uevent;
+
+		parse_acpi_supply(fx->buf, &info);
+		if (info.capacity != fx->capacity || info.now != fx->now) {
+			fprintf(stderr, "ueventbench: %s: capacity %d now %lld\n",
+				fx->name, info.capacity, info.now);
+			bad = 1;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &a);
+		for (r = 0; r < rounds; r++) {
+			parse_acpi_supply(fx->buf, &info);
+			sink += info.capacity;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &b);
+		single = elapsed(&a, &b) / rounds;
+
+		clock_gettime(CLOCK_MONOTONIC, &a);
+		for (r = 0; r < rounds; r++)
+			sink += scan_all(fx->buf);
+		clock_gettime(CLOCK_MONOTONIC, &b);
+		scans = elapsed(&a, &b) / rounds;
+
+		/* the same keys in a uevent message, NUL separated */
+		if (len >= sizeof(msg))
+			len = sizeof(msg) - 1;
+		memcpy(msg, fx->buf, len);
+		for (r = 0; r < (int)len; r++) {
+			if (msg[r] == '\n')
+				msg[r] = '\0';
+		}
+		clock_gettime(CLOCK_MONOTONIC, &a);
+		for (r = 0; r < rounds; r++) {
+			parse_acpi_uevent(msg, len, &info);
+			sink += info.capacity;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &b);
+		uevent = elapsed(&a, &b) / rounds;
+		if (info.capacity != fx->capacity || info.now != fx->now)
+			bad = 1;
+
+		printf("ueventbench: %-16s %4zu bytes: single pass %.0f ns, uevent %.0f ns, 6 scans %.0f ns\n",
+			fx->name, len, single, uevent, scans);
+	}
+	return bad;
+}